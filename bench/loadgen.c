@@ -0,0 +1,322 @@
+/* chinadns-loadgen: replay a domain-name corpus against a dns server */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __FreeBSD__
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#endif
+#undef _GNU_SOURCE
+
+#define PACKET_MAXSIZE 4096
+#define DNAME_MAXLEN 254
+#define CORPUS_MAXFILES 8
+#define DNS_HEADER_LEN 12
+#define MSGID_COUNT 65536
+
+/* in-flight query slot (indexed by msgid) */
+typedef struct {
+    uint64_t sent_us;
+    bool     inflight;
+} slot_t;
+
+/* cpu/memory usage of the benchmarked process */
+typedef struct {
+    uint64_t cpu_us;
+    uint64_t rss_kb;
+} procstat_t;
+
+static const char *g_server_ipstr  = "127.0.0.1";
+static uint16_t    g_server_port   = 65353;
+static const char *g_corpus_fnames[CORPUS_MAXFILES];
+static int         g_corpus_fcount = 0;
+static uint32_t    g_rate          = 0; /* queries per second, 0: unlimited */
+static uint32_t    g_duration_sec  = 10;
+static uint32_t    g_max_inflight  = 1000;
+static uint32_t    g_timeout_ms    = 2000;
+static uint16_t    g_qtype         = 1; /* A */
+static long        g_target_pid    = 0; /* process to sample cpu/memory from */
+
+static char      **g_dnames      = NULL;
+static size_t      g_dname_count = 0;
+static slot_t     *g_slots       = NULL;
+static uint32_t   *g_latencies   = NULL; /* in microseconds */
+static size_t      g_latency_cnt = 0;
+static size_t      g_latency_cap = 0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_help(void) {
+    printf("usage: chinadns-loadgen <options...> -f <corpus-file>. the existing options are as follows:\n"
+           " -s, --server <ip-address>            dns server address, default: 127.0.0.1\n"
+           " -p, --port <port-number>             dns server port, default: 65353\n"
+           " -f, --corpus <file-path>             domain name list (repeatable, max 8)\n"
+           " -r, --rate <qps>                     queries per second, default: 0 (unlimited)\n"
+           " -d, --duration <seconds>             length of the run, default: 10\n"
+           " -c, --concurrency <count>            max in-flight queries, default: 1000\n"
+           " -T, --timeout-ms <milliseconds>      query timeout, default: 2000\n"
+           " -6, --aaaa                           send AAAA queries instead of A\n"
+           " -P, --pid <pid>                      report cpu and memory used by this process\n"
+           " -h, --help                           print help information and exit\n");
+}
+
+static void load_corpus(const char *fname) {
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        printf("[load_corpus] failed to open '%s': (%d) %s\n", fname, errno, strerror(errno));
+        exit(errno);
+    }
+    char dname[DNAME_MAXLEN];
+    size_t capacity = g_dname_count;
+    while (fscanf(fp, "%253s", dname) > 0) {
+        if (dname[0] == '#') continue;
+        if (g_dname_count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            g_dnames = realloc(g_dnames, capacity * sizeof(char *));
+        }
+        g_dnames[g_dname_count++] = strdup(dname);
+    }
+    fclose(fp);
+}
+
+/* encode a standard query, return the packet length */
+static size_t build_query(uint8_t *packet, uint16_t msgid, const char *dname) {
+    memset(packet, 0, DNS_HEADER_LEN);
+    packet[0] = msgid >> 8; packet[1] = msgid & 0xff;
+    packet[2] = 0x01; /* rd */
+    packet[5] = 1;    /* qdcount */
+    size_t offset = DNS_HEADER_LEN;
+    for (const char *label = dname; *label;) {
+        const char *dot = strchr(label, '.');
+        size_t labellen = dot ? (size_t)(dot - label) : strlen(label);
+        if (labellen == 0 || labellen > 63) break;
+        packet[offset++] = labellen;
+        memcpy(packet + offset, label, labellen);
+        offset += labellen;
+        label += labellen + (dot ? 1 : 0);
+    }
+    packet[offset++] = 0;
+    packet[offset++] = g_qtype >> 8; packet[offset++] = g_qtype & 0xff;
+    packet[offset++] = 0; packet[offset++] = 1; /* class IN */
+    return offset;
+}
+
+static void record_latency(uint32_t latency_us) {
+    if (g_latency_cnt == g_latency_cap) {
+        g_latency_cap = g_latency_cap ? g_latency_cap * 2 : 65536;
+        g_latencies = realloc(g_latencies, g_latency_cap * sizeof(uint32_t));
+    }
+    g_latencies[g_latency_cnt++] = latency_us;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(double pct) {
+    if (g_latency_cnt == 0) return 0;
+    size_t index = (size_t)(pct / 100 * (g_latency_cnt - 1) + 0.5);
+    return g_latencies[index] / 1000.0;
+}
+
+/* sample cpu time (user+sys) and resident memory of the target process */
+static bool read_procstat(long pid, procstat_t *stat) {
+#if defined(__linux__)
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[len] = 0;
+    char *ptr = strrchr(buf, ')'); /* skip "pid (comm)" */
+    if (!ptr) return false;
+    unsigned long utime = 0, stime = 0;
+    long rss_pages = 0;
+    /* fields 3..24: state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime stime ... rss */
+    if (sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+               &utime, &stime, &rss_pages) != 3) return false;
+    long ticks = sysconf(_SC_CLK_TCK);
+    stat->cpu_us = (utime + stime) * (uint64_t)1000000 / ticks;
+    stat->rss_kb = rss_pages * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+    return true;
+#elif defined(__FreeBSD__)
+    struct kinfo_proc kp;
+    size_t len = sizeof(kp);
+    int mib[4] = {CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pid};
+    if (sysctl(mib, 4, &kp, &len, NULL, 0) || len != sizeof(kp)) return false;
+    struct rusage *ru = &kp.ki_rusage;
+    stat->cpu_us = (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * (uint64_t)1000000 + ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+    stat->rss_kb = kp.ki_rssize * (uint64_t)getpagesize() / 1024;
+    return true;
+#else
+    (void)pid; (void)stat;
+    return false;
+#endif
+}
+
+static void parse_args(int argc, char *argv[]) {
+    const struct option options[] = {
+        {"server",      required_argument, NULL, 's'},
+        {"port",        required_argument, NULL, 'p'},
+        {"corpus",      required_argument, NULL, 'f'},
+        {"rate",        required_argument, NULL, 'r'},
+        {"duration",    required_argument, NULL, 'd'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"timeout-ms",  required_argument, NULL, 'T'},
+        {"aaaa",        no_argument,       NULL, '6'},
+        {"pid",         required_argument, NULL, 'P'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL,          0,                 NULL,  0 },
+    };
+    int shortopt;
+    while ((shortopt = getopt_long(argc, argv, "s:p:f:r:d:c:T:6P:h", options, NULL)) != -1) {
+        switch (shortopt) {
+            case 's': g_server_ipstr = optarg; break;
+            case 'p': g_server_port = strtoul(optarg, NULL, 10); break;
+            case 'f':
+                if (g_corpus_fcount == CORPUS_MAXFILES) goto BAD_ARG;
+                g_corpus_fnames[g_corpus_fcount++] = optarg;
+                break;
+            case 'r': g_rate = strtoul(optarg, NULL, 10); break;
+            case 'd': g_duration_sec = strtoul(optarg, NULL, 10); break;
+            case 'c': g_max_inflight = strtoul(optarg, NULL, 10); break;
+            case 'T': g_timeout_ms = strtoul(optarg, NULL, 10); break;
+            case '6': g_qtype = 28; break;
+            case 'P': g_target_pid = strtol(optarg, NULL, 10); break;
+            case 'h': print_help(); exit(0);
+            default: goto BAD_ARG;
+        }
+    }
+    if (g_corpus_fcount == 0 || g_duration_sec == 0 || g_max_inflight == 0 || g_max_inflight > MSGID_COUNT / 2) goto BAD_ARG;
+    return;
+BAD_ARG:
+    print_help();
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    for (int i = 0; i < g_corpus_fcount; ++i) load_corpus(g_corpus_fnames[i]);
+    if (g_dname_count == 0) {
+        printf("[main] the corpus is empty\n");
+        return 1;
+    }
+
+    struct sockaddr_storage server_addr = {0};
+    socklen_t server_addrlen = 0;
+    struct sockaddr_in *addr4 = (void *)&server_addr;
+    struct sockaddr_in6 *addr6 = (void *)&server_addr;
+    if (inet_pton(AF_INET, g_server_ipstr, &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(g_server_port);
+        server_addrlen = sizeof(*addr4);
+    } else if (inet_pton(AF_INET6, g_server_ipstr, &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(g_server_port);
+        server_addrlen = sizeof(*addr6);
+    } else {
+        printf("[main] invalid server ip address: %s\n", g_server_ipstr);
+        return 1;
+    }
+    int sockfd = socket(server_addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0 || connect(sockfd, (void *)&server_addr, server_addrlen)) {
+        printf("[main] failed to connect to %s#%hu: (%d) %s\n", g_server_ipstr, g_server_port, errno, strerror(errno));
+        return errno;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &(int){4 << 20}, sizeof(int));
+
+    g_slots = calloc(MSGID_COUNT, sizeof(slot_t));
+    procstat_t stat_begin = {0}, stat_end = {0};
+    bool has_procstat = g_target_pid > 0 && read_procstat(g_target_pid, &stat_begin);
+
+    printf("[main] %zu names, server %s#%hu, rate %u qps, %u seconds, %u in flight\n",
+           g_dname_count, g_server_ipstr, g_server_port, g_rate, g_duration_sec, g_max_inflight);
+
+    uint8_t packet[PACKET_MAXSIZE];
+    uint64_t sent = 0, received = 0, timeouts = 0, errors = 0;
+    uint32_t inflight = 0;
+    uint16_t next_msgid = 0;
+    uint16_t oldest_msgid = 0; /* timeouts are scanned in send order */
+    uint64_t start_us = now_us(), end_us = start_us + g_duration_sec * (uint64_t)1000000;
+
+    while (true) {
+        uint64_t now = now_us();
+        bool sending = now < end_us;
+        if (!sending && inflight == 0) break;
+        if (!sending && now > end_us + g_timeout_ms * (uint64_t)1000) break;
+
+        /* send as many queries as the rate and the in-flight limit allow */
+        uint64_t allowed = g_rate ? (now - start_us) * g_rate / 1000000 + 1 : UINT64_MAX;
+        while (sending && sent < allowed && inflight < g_max_inflight) {
+            slot_t *slot = &g_slots[next_msgid];
+            if (slot->inflight) break; /* wrapped onto a query that has not timed out yet */
+            size_t length = build_query(packet, next_msgid, g_dnames[sent % g_dname_count]);
+            if (send(sockfd, packet, length, 0) < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) ++errors;
+                break;
+            }
+            slot->sent_us = now_us();
+            slot->inflight = true;
+            ++inflight; ++sent; ++next_msgid;
+        }
+
+        /* expire timed out queries */
+        now = now_us();
+        while (oldest_msgid != next_msgid) {
+            slot_t *slot = &g_slots[oldest_msgid];
+            if (slot->inflight) {
+                if (now - slot->sent_us < g_timeout_ms * (uint64_t)1000) break;
+                slot->inflight = false;
+                --inflight; ++timeouts;
+            }
+            ++oldest_msgid;
+        }
+
+        struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+        int wait_ms = (g_rate && inflight < g_max_inflight) ? 1 : 10;
+        if (poll(&pfd, 1, wait_ms) <= 0) continue;
+        ssize_t length;
+        while ((length = recv(sockfd, packet, sizeof(packet), 0)) >= 0) {
+            if (length < DNS_HEADER_LEN) continue;
+            uint16_t msgid = (packet[0] << 8) | packet[1];
+            slot_t *slot = &g_slots[msgid];
+            if (!slot->inflight) continue;
+            slot->inflight = false;
+            --inflight; ++received;
+            record_latency(now_us() - slot->sent_us);
+        }
+    }
+
+    timeouts += inflight; /* still unanswered when the run ended */
+    double elapsed_sec = (now_us() - start_us) / 1e6;
+    qsort(g_latencies, g_latency_cnt, sizeof(uint32_t), cmp_u32);
+    printf("sent: %lu, received: %lu, timeouts: %lu, send errors: %lu\n",
+           (unsigned long)sent, (unsigned long)received, (unsigned long)timeouts, (unsigned long)errors);
+    printf("throughput: %.0f qps (%.2f seconds)\n", received / elapsed_sec, elapsed_sec);
+    printf("latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+           percentile_ms(50), percentile_ms(99), percentile_ms(99.9), percentile_ms(100));
+    if (has_procstat && read_procstat(g_target_pid, &stat_end)) {
+        uint64_t cpu_us = stat_end.cpu_us - stat_begin.cpu_us;
+        printf("target pid %ld: cpu %.3f s, %.2f us/query, rss %lu KiB\n", g_target_pid, cpu_us / 1e6,
+               received ? (double)cpu_us / received : 0.0, (unsigned long)stat_end.rss_kb);
+    }
+    return 0;
+}
@@ -0,0 +1,302 @@
+/* chinadns-microbench: time the per-query lookups against the shipped lists */
+#define _GNU_SOURCE
+#include "../chinadns.h"
+#include "../dnlutils.h"
+#include "../dnsutils.h"
+#include "../netutils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#undef _GNU_SOURCE
+
+#define SAMPLE_COUNT 65536 /* power of 2, inputs are cycled through */
+#define SAMPLE_MASK (SAMPLE_COUNT - 1)
+#define PACKET_MAXSIZE 512
+
+/* globals normally defined by chinadns.c */
+bool g_noip_as_chnip = false;
+char g_ipset_setname4[IPSET_MAXNAMELEN] = "chnroute";
+char g_ipset_setname6[IPSET_MAXNAMELEN] = "chnroute6";
+
+static uint64_t g_iterations = 1000000;
+static unsigned g_hit_percent = 50;
+static uint64_t g_rand_state  = 0x9e3779b97f4a7c15ULL;
+
+static volatile uint64_t g_sink; /* keeps the results alive */
+
+/* random number generator (xorshift64*) */
+static uint64_t rand64(void) {
+    g_rand_state ^= g_rand_state >> 12;
+    g_rand_state ^= g_rand_state << 25;
+    g_rand_state ^= g_rand_state >> 27;
+    return g_rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+static bool is_hit(void) {
+    return rand64() % 100 < g_hit_percent;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000000000 + ts.tv_nsec;
+}
+
+/* hardware cache-miss counter (linux perf events only) */
+static int g_perf_fd = -1;
+
+static void perf_open(void) {
+#ifdef __linux__
+    struct perf_event_attr attr = {0};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    g_perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+static void perf_start(void) {
+#ifdef __linux__
+    if (g_perf_fd < 0) return;
+    ioctl(g_perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(g_perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+static int64_t perf_stop(void) {
+#ifdef __linux__
+    uint64_t count = 0;
+    if (g_perf_fd < 0) return -1;
+    ioctl(g_perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(g_perf_fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+#else
+    return -1;
+#endif
+}
+
+static void report(const char *name, uint64_t elapsed_ns, int64_t misses, uint64_t hits) {
+    printf("%-28s %8.1f ns/op", name, (double)elapsed_ns / g_iterations);
+    if (misses >= 0) {
+        printf("  %6.3f cache-miss/op", (double)misses / g_iterations);
+    } else {
+        printf("  cache-miss/op: n/a");
+    }
+    printf("  hit: %5.1f%%\n", hits * 100.0 / g_iterations);
+}
+
+/* read a list file (one entry per line) */
+static char **load_lines(const char *fname, size_t *count) {
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        printf("[load_lines] failed to open '%s': (%d) %s\n", fname, errno, strerror(errno));
+        exit(errno);
+    }
+    char **lines = NULL, buf[DNS_DOMAIN_NAME_MAXLEN];
+    size_t capacity = 0;
+    *count = 0;
+    while (fscanf(fp, "%253s", buf) > 0) {
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            lines = realloc(lines, capacity * sizeof(char *));
+        }
+        lines[(*count)++] = strdup(buf);
+    }
+    fclose(fp);
+    return lines;
+}
+
+/* encode "www.example.com" as a query (rd=1, qdcount=1) */
+static size_t build_query(uint8_t *packet, const char *dname, uint16_t qtype) {
+    memset(packet, 0, sizeof(dns_header_t));
+    packet[2] = 0x01;
+    packet[5] = 1;
+    size_t offset = sizeof(dns_header_t);
+    for (const char *label = dname; *label;) {
+        const char *dot = strchr(label, '.');
+        size_t labellen = dot ? (size_t)(dot - label) : strlen(label);
+        packet[offset++] = labellen;
+        memcpy(packet + offset, label, labellen);
+        offset += labellen;
+        label += labellen + (dot ? 1 : 0);
+    }
+    packet[offset++] = 0;
+    packet[offset++] = qtype >> 8; packet[offset++] = qtype & 0xff;
+    packet[offset++] = 0; packet[offset++] = 1;
+    return offset;
+}
+
+/* turn the query into a reply with one A record */
+static size_t build_reply(uint8_t *packet, size_t length, uint32_t ipaddr) {
+    dns_header_t *header = (dns_header_t *)packet;
+    header->qr = DNS_QR_REPLY;
+    header->answer_count = htons(1);
+    uint8_t *rr = packet + length;
+    rr[0] = 0xc0; rr[1] = sizeof(dns_header_t);
+    rr[2] = 0; rr[3] = DNS_RECORD_TYPE_A;
+    rr[4] = 0; rr[5] = DNS_CLASS_INTERNET;
+    rr[6] = 0; rr[7] = 0; rr[8] = 0x0e; rr[9] = 0x10;
+    rr[10] = 0; rr[11] = IPV4_BINADDR_LEN;
+    memcpy(rr + 12, &ipaddr, IPV4_BINADDR_LEN);
+    return length + 12 + IPV4_BINADDR_LEN;
+}
+
+/* random address inside a random chnroute prefix (hit) or anywhere (mostly miss) */
+static void random_addr4(char **routes, size_t route_count, uint32_t *addr, bool hit) {
+    if (!hit) {
+        *addr = rand64();
+        return;
+    }
+    char ipstr[INET6_ADDRSTRLEN];
+    const char *route = routes[rand64() % route_count];
+    const char *slash = strchr(route, '/');
+    size_t iplen = slash - route;
+    memcpy(ipstr, route, iplen);
+    ipstr[iplen] = 0;
+    uint32_t net;
+    inet_pton(AF_INET, ipstr, &net);
+    unsigned prefix = atoi(slash + 1);
+    uint32_t hostmask = prefix >= 32 ? 0 : 0xffffffffu >> prefix;
+    *addr = htonl(ntohl(net) | ((uint32_t)rand64() & hostmask));
+}
+
+static void random_addr6(char **routes, size_t route_count, uint8_t addr[16], bool hit) {
+    uint64_t hi = rand64(), lo = rand64();
+    memcpy(addr, &hi, 8);
+    memcpy(addr + 8, &lo, 8);
+    if (!hit) {
+        addr[0] = 0x20 | (addr[0] & 0x1f); /* 2000::/3 (global unicast) */
+        return;
+    }
+    char ipstr[INET6_ADDRSTRLEN];
+    const char *route = routes[rand64() % route_count];
+    const char *slash = strrchr(route, '/');
+    size_t iplen = slash - route;
+    memcpy(ipstr, route, iplen);
+    ipstr[iplen] = 0;
+    uint8_t net[16];
+    inet_pton(AF_INET6, ipstr, net);
+    unsigned prefix = atoi(slash + 1);
+    for (unsigned i = 0; i < 16; ++i) {
+        unsigned bits = prefix > i * 8 ? prefix - i * 8 : 0;
+        uint8_t mask = bits >= 8 ? 0xff : (uint8_t)(0xff << (8 - bits));
+        addr[i] = (net[i] & mask) | (addr[i] & ~mask);
+    }
+}
+
+static void print_help(void) {
+    printf("usage: chinadns-microbench [-n iterations] [-H hit-percent] (run from the source root)\n"
+           " -n <iterations>    lookups per benchmark, default: 1000000\n"
+           " -H <hit-percent>   share of inputs that hit a list/route, default: 50\n"
+           " -s <seed>          random seed, default: fixed\n");
+}
+
+int main(int argc, char *argv[]) {
+    int shortopt;
+    while ((shortopt = getopt(argc, argv, "n:H:s:h")) != -1) {
+        switch (shortopt) {
+            case 'n': g_iterations = strtoull(optarg, NULL, 10); break;
+            case 'H': g_hit_percent = strtoul(optarg, NULL, 10); break;
+            case 's': g_rand_state = strtoull(optarg, NULL, 10) | 1; break;
+            case 'h': print_help(); return 0;
+            default: print_help(); return 1;
+        }
+    }
+    if (g_iterations == 0 || g_hit_percent > 100) {
+        print_help();
+        return 1;
+    }
+
+    printf("gfwlist entries: %zu\n", dnl_init("gfwlist.txt", true));
+    printf("chnlist entries: %zu\n", dnl_init("chnlist.txt", false));
+    chnroute_init();
+    perf_open();
+
+    size_t gfw_count, chn_count, route4_count, route6_count;
+    char **gfwlist = load_lines("gfwlist.txt", &gfw_count);
+    char **chnlist = load_lines("chnlist.txt", &chn_count);
+    char **routes4 = load_lines("chnroute.txt", &route4_count);
+    char **routes6 = load_lines("chnroute6.txt", &route6_count);
+
+    /* inputs: listed names get a "www." prefix, misses get a made-up suffix */
+    char (*dnames)[DNS_DOMAIN_NAME_MAXLEN] = malloc(SAMPLE_COUNT * DNS_DOMAIN_NAME_MAXLEN);
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+        if (is_hit()) {
+            const char *entry = (rand64() & 1) ? gfwlist[rand64() % gfw_count] : chnlist[rand64() % chn_count];
+            snprintf(dnames[i], DNS_DOMAIN_NAME_MAXLEN, "www.%s", entry);
+        } else {
+            snprintf(dnames[i], DNS_DOMAIN_NAME_MAXLEN, "host%u.nomatch%u.example", (unsigned)(rand64() % 1000), (unsigned)(rand64() % 100000));
+        }
+    }
+    uint32_t *addrs4 = malloc(SAMPLE_COUNT * sizeof(uint32_t));
+    uint8_t (*addrs6)[IPV6_BINADDR_LEN] = malloc(SAMPLE_COUNT * IPV6_BINADDR_LEN);
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+        random_addr4(routes4, route4_count, &addrs4[i], is_hit());
+        random_addr6(routes6, route6_count, addrs6[i], is_hit());
+    }
+    uint8_t (*queries)[PACKET_MAXSIZE] = malloc(SAMPLE_COUNT * PACKET_MAXSIZE);
+    uint8_t (*replies)[PACKET_MAXSIZE] = malloc(SAMPLE_COUNT * PACKET_MAXSIZE);
+    uint16_t *query_lens = malloc(SAMPLE_COUNT * sizeof(uint16_t));
+    uint16_t *reply_lens = malloc(SAMPLE_COUNT * sizeof(uint16_t));
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i) {
+        query_lens[i] = build_query(queries[i], dnames[i], DNS_RECORD_TYPE_A);
+        memcpy(replies[i], queries[i], query_lens[i]);
+        reply_lens[i] = build_reply(replies[i], query_lens[i], addrs4[i]);
+    }
+
+    uint64_t begin, hits;
+    int64_t misses;
+    char name_buf[DNS_DOMAIN_NAME_MAXLEN];
+    printf("iterations: %llu, hit ratio of the inputs: %u%%\n", (unsigned long long)g_iterations, g_hit_percent);
+
+    hits = 0; perf_start(); begin = now_ns();
+    for (uint64_t i = 0; i < g_iterations; ++i) hits += dnl_ismatch(dnames[i & SAMPLE_MASK], true, NULL) != DNL_MRESULT_NOMATCH;
+    misses = perf_stop();
+    report("dnl_ismatch", now_ns() - begin, misses, hits);
+
+    hits = 0; perf_start(); begin = now_ns();
+    for (uint64_t i = 0; i < g_iterations; ++i) hits += ipset_addr_is_exists(&addrs4[i & SAMPLE_MASK], true);
+    misses = perf_stop();
+    report("ipset_addr_is_exists(v4)", now_ns() - begin, misses, hits);
+
+    hits = 0; perf_start(); begin = now_ns();
+    for (uint64_t i = 0; i < g_iterations; ++i) hits += ipset_addr_is_exists(addrs6[i & SAMPLE_MASK], false);
+    misses = perf_stop();
+    report("ipset_addr_is_exists(v6)", now_ns() - begin, misses, hits);
+
+    hits = 0; perf_start(); begin = now_ns();
+    for (uint64_t i = 0; i < g_iterations; ++i) {
+        uint16_t qtype;
+        hits += dns_query_check(queries[i & SAMPLE_MASK], query_lens[i & SAMPLE_MASK], name_buf, &qtype);
+    }
+    misses = perf_stop();
+    report("dns_query_check(+name)", now_ns() - begin, misses, hits);
+
+    hits = 0; perf_start(); begin = now_ns();
+    for (uint64_t i = 0; i < g_iterations; ++i) hits += dns_reply_check(replies[i & SAMPLE_MASK], reply_lens[i & SAMPLE_MASK], NULL, true);
+    misses = perf_stop();
+    report("dns_reply_check(+ipset)", now_ns() - begin, misses, hits);
+
+    hits = 0; perf_start(); begin = now_ns();
+    for (uint64_t i = 0; i < g_iterations; ++i) hits += dns_question_hash(replies[i & SAMPLE_MASK], reply_lens[i & SAMPLE_MASK]) != 0;
+    misses = perf_stop();
+    report("dns_question_hash(pre-check)", now_ns() - begin, misses, hits);
+
+    g_sink = hits;
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# run chinadns-ng against two local stub upstreams and replay the domain lists.
+# usage: bench/run-bench.sh [loadgen options...]   (run from the source root after `make bench`)
+#   CHINA_DELAY / TRUST_DELAY: reply delay of the china/trust stub (ms), default 5/30
+#   STUB_ARGS: extra options for both stubs (e.g. "-L 1 -j 20" for loss and jitter)
+#   CHINADNS_ARGS: extra options for chinadns-ng
+set -e
+
+CHINA_PORT=5301
+TRUST_PORT=5302
+BIND_PORT=65353
+
+# listed names get china/foreign answers from both sides, unlisted ones get the stub's own side
+./bench/chinadns-stub -l $CHINA_PORT -C chnlist.txt -G gfwlist.txt -a 114.80.1.1 -A 2001:250::1 \
+    -d ${CHINA_DELAY:-5} $STUB_ARGS >/dev/null &
+china_pid=$!
+./bench/chinadns-stub -l $TRUST_PORT -C chnlist.txt -G gfwlist.txt -a 8.8.8.8 -A 2001:4860::8888 \
+    -d ${TRUST_DELAY:-30} $STUB_ARGS >/dev/null &
+trust_pid=$!
+./chinadns-ng -l $BIND_PORT -c 127.0.0.1#$CHINA_PORT -t 127.0.0.1#$TRUST_PORT \
+    -g gfwlist.txt -m chnlist.txt $CHINADNS_ARGS >/dev/null &
+chinadns_pid=$!
+trap 'kill $china_pid $trust_pid $chinadns_pid 2>/dev/null' EXIT INT TERM
+
+sleep 2 # wait for the domain lists and chnroute to be loaded
+
+./bench/chinadns-loadgen -p $BIND_PORT -f gfwlist.txt -f chnlist.txt -P $chinadns_pid "$@"
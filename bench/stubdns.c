@@ -0,0 +1,455 @@
+/* chinadns-stub: a local stub upstream dns server for offline tests and benchmarks */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#undef _GNU_SOURCE
+
+#define PACKET_MAXSIZE 4096
+#define PENDING_MAXCOUNT 8192 /* replies waiting for their delay */
+#define DNAME_MAXLEN 254
+#define DNS_HEADER_LEN 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+/* rule_t.action */
+#define ACTION_DEFAULT  0 // -a/-A answer (or no answer)
+#define ACTION_CHINA    1 // china ip answer
+#define ACTION_FOREIGN  2 // foreign ip answer
+#define ACTION_ADDRESS  3 // fixed address from the rule
+#define ACTION_NXDOMAIN 4 // rcode=NXDOMAIN
+#define ACTION_SERVFAIL 5 // rcode=SERVFAIL
+#define ACTION_DROP     6 // never reply
+
+/* answer of one domain suffix */
+typedef struct {
+    char    *suffix;     // "example.com" (lowercase)
+    uint8_t  action;     // ACTION_*
+    bool     is_ipv4;    // family of `address`
+    uint8_t  address[16];
+    int32_t  delay_ms;   // -1: use the global delay
+} rule_t;
+
+/* delayed reply (min-heap ordered by due time) */
+typedef struct {
+    uint64_t due_ms;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint16_t length;
+    uint8_t  packet[PACKET_MAXSIZE];
+} pending_t;
+
+static const char *g_bind_ipstr   = "127.0.0.1";
+static uint16_t    g_bind_port    = 5353;
+static uint8_t     g_answer4[4];
+static uint8_t     g_answer6[16];
+static bool        g_has_answer4  = false;
+static bool        g_has_answer6  = false;
+static uint8_t     g_china4[4];
+static uint8_t     g_china6[16];
+static uint8_t     g_foreign4[4];
+static uint8_t     g_foreign6[16];
+static uint32_t    g_delay_ms     = 0;
+static uint32_t    g_jitter_ms    = 0;
+static uint32_t    g_loss_pct     = 0;
+static uint32_t    g_truncate_pct = 0;
+static uint32_t    g_answer_ttl   = 300;
+static int         g_sockfd       = -1;
+static uint64_t    g_rand_state   = 0x2545f4914f6cdd1dULL;
+
+static rule_t     *g_rules        = NULL; /* open addressing hash table */
+static size_t      g_rule_cap     = 0;    /* power of 2 */
+static size_t      g_rule_cnt     = 0;
+
+static pending_t  *g_pending      = NULL;
+static pending_t **g_pending_heap = NULL;
+static pending_t **g_pending_free = NULL;
+static size_t      g_pending_cnt  = 0;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t)1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t rand32(void) {
+    g_rand_state ^= g_rand_state >> 12;
+    g_rand_state ^= g_rand_state << 25;
+    g_rand_state ^= g_rand_state >> 27;
+    return (g_rand_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static void print_help(void) {
+    printf("usage: chinadns-stub <options...>. the existing options are as follows:\n"
+           " -b, --bind-addr <ip-address>         listen address, default: 127.0.0.1\n"
+           " -l, --bind-port <port-number>        listen port number, default: 5353\n"
+           " -a, --answer4 <ipv4-address>         A answer of unmatched names, default: <none>\n"
+           " -A, --answer6 <ipv6-address>         AAAA answer of unmatched names, default: <none>\n"
+           " -r, --rule-file <file-path>          per-suffix answers, see below (repeatable)\n"
+           " -C, --china-list <file-path>         answer names under these suffixes with china ip\n"
+           " -G, --foreign-list <file-path>       answer names under these suffixes with foreign ip\n"
+           " -c, --china-ip <ip-address>          china answer, default: 114.80.1.1, 2001:250::1\n"
+           " -f, --foreign-ip <ip-address>        foreign answer, default: 8.8.8.8, 2001:4860::8888\n"
+           " -d, --delay-ms <milliseconds>        delay of every reply, default: 0\n"
+           " -j, --jitter-ms <milliseconds>       add a random 0~N ms to the delay, default: 0\n"
+           " -L, --loss <percent>                 drop this share of the queries, default: 0\n"
+           " -t, --truncate <percent>             reply with TC=1 and no answer, default: 0\n"
+           " -T, --ttl <seconds>                  ttl of the answer records, default: 300\n"
+           " -h, --help                           print help information and exit\n"
+           "rule file: one `<domain-suffix> <answer> [delay-ms]` per line, '#' starts a comment,\n"
+           "  answer: chn | foreign | nxdomain | servfail | drop | <ipv4/ipv6 address>\n");
+}
+
+static uint32_t hash_name(const char *name, size_t namelen) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < namelen; ++i) hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash;
+}
+
+static rule_t *rule_find(const char *name, size_t namelen) {
+    if (g_rule_cap == 0) return NULL;
+    for (size_t i = hash_name(name, namelen) & (g_rule_cap - 1);; i = (i + 1) & (g_rule_cap - 1)) {
+        rule_t *rule = &g_rules[i];
+        if (!rule->suffix) return NULL;
+        if (strlen(rule->suffix) == namelen && !memcmp(rule->suffix, name, namelen)) return rule;
+    }
+}
+
+static void rule_add(const rule_t *newrule) {
+    if ((g_rule_cnt + 1) * 2 > g_rule_cap) {
+        rule_t *oldrules = g_rules;
+        size_t oldcap = g_rule_cap;
+        g_rule_cap = g_rule_cap ? g_rule_cap * 2 : 1024;
+        g_rules = calloc(g_rule_cap, sizeof(rule_t));
+        g_rule_cnt = 0;
+        for (size_t i = 0; i < oldcap; ++i) {
+            if (oldrules[i].suffix) rule_add(&oldrules[i]);
+        }
+        free(oldrules);
+    }
+    size_t namelen = strlen(newrule->suffix);
+    size_t i = hash_name(newrule->suffix, namelen) & (g_rule_cap - 1);
+    while (g_rules[i].suffix && strcmp(g_rules[i].suffix, newrule->suffix)) i = (i + 1) & (g_rule_cap - 1);
+    if (!g_rules[i].suffix) ++g_rule_cnt;
+    free(g_rules[i].suffix == newrule->suffix ? NULL : g_rules[i].suffix);
+    g_rules[i] = *newrule;
+}
+
+/* "<suffix> <answer> [delay-ms]" or "<suffix>" with the given default action */
+static void load_rules(const char *fname, uint8_t default_action) {
+    FILE *fp = fopen(fname, "r");
+    if (!fp) {
+        printf("[load_rules] failed to open '%s': (%d) %s\n", fname, errno, strerror(errno));
+        exit(errno);
+    }
+    char line[512];
+    unsigned lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        ++lineno;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = 0;
+        char suffix[DNAME_MAXLEN] = {0}, answer[64] = {0};
+        int delay_ms = -1;
+        int fields = sscanf(line, "%253s %63s %d", suffix, answer, &delay_ms);
+        if (fields <= 0) continue;
+
+        rule_t rule = {.delay_ms = delay_ms < 0 ? -1 : delay_ms};
+        if (fields == 1) {
+            if (default_action == ACTION_DEFAULT) goto BAD_LINE;
+            rule.action = default_action;
+        } else if (!strcasecmp(answer, "chn")) {
+            rule.action = ACTION_CHINA;
+        } else if (!strcasecmp(answer, "foreign")) {
+            rule.action = ACTION_FOREIGN;
+        } else if (!strcasecmp(answer, "nxdomain")) {
+            rule.action = ACTION_NXDOMAIN;
+        } else if (!strcasecmp(answer, "servfail")) {
+            rule.action = ACTION_SERVFAIL;
+        } else if (!strcasecmp(answer, "drop")) {
+            rule.action = ACTION_DROP;
+        } else if (inet_pton(AF_INET, answer, rule.address) == 1) {
+            rule.action = ACTION_ADDRESS;
+            rule.is_ipv4 = true;
+        } else if (inet_pton(AF_INET6, answer, rule.address) == 1) {
+            rule.action = ACTION_ADDRESS;
+        } else {
+            goto BAD_LINE;
+        }
+        for (char *c = suffix; *c; ++c) *c = tolower((unsigned char)*c);
+        size_t suffixlen = strlen(suffix);
+        if (suffixlen > 1 && suffix[suffixlen - 1] == '.') suffix[suffixlen - 1] = 0;
+        rule.suffix = strdup(suffix);
+        rule_add(&rule);
+        continue;
+BAD_LINE:
+        printf("[load_rules] %s:%u: invalid rule\n", fname, lineno);
+        exit(1);
+    }
+    fclose(fp);
+}
+
+/* longest matching suffix of the (lowercase) qname */
+static const rule_t *rule_match(const char *dname) {
+    for (const char *suffix = dname; suffix; suffix = strchr(suffix, '.') ? strchr(suffix, '.') + 1 : NULL) {
+        const rule_t *rule = rule_find(suffix, strlen(suffix));
+        if (rule) return rule;
+    }
+    return NULL;
+}
+
+/* turn the query into a reply (in place), return the reply length or 0 to drop */
+static size_t build_reply(uint8_t *packet, size_t length, int32_t *delay_ms) {
+    if (length < DNS_HEADER_LEN + 5 || (packet[2] & 0x80)) return 0;
+    char dname[DNAME_MAXLEN] = {0};
+    size_t offset = DNS_HEADER_LEN, namelen = 0;
+    while (offset < length && packet[offset] != 0) {
+        uint8_t labellen = packet[offset];
+        if (labellen > 63 || offset + labellen + 1 > length || namelen + labellen + 1 >= DNAME_MAXLEN) return 0;
+        if (namelen) dname[namelen++] = '.';
+        for (uint8_t i = 0; i < labellen; ++i) dname[namelen++] = tolower(packet[offset + 1 + i]);
+        offset += labellen + 1;
+    }
+    if (offset + 5 > length) return 0;
+    uint16_t qtype = (packet[offset + 1] << 8) | packet[offset + 2];
+    offset += 5; /* '\0' + qtype + qclass */
+
+    const rule_t *rule = rule_match(dname);
+    uint8_t action = rule ? rule->action : ACTION_DEFAULT;
+    *delay_ms = rule ? rule->delay_ms : -1;
+    if (action == ACTION_DROP) return 0;
+
+    const uint8_t *rdata = NULL;
+    uint16_t rdatalen = 0;
+    uint8_t rcode = 0;
+    bool is_ipv4 = qtype == DNS_TYPE_A, is_ipv6 = qtype == DNS_TYPE_AAAA;
+    switch (action) {
+        case ACTION_DEFAULT:
+            if (is_ipv4 && g_has_answer4) rdata = g_answer4;
+            if (is_ipv6 && g_has_answer6) rdata = g_answer6;
+            break;
+        case ACTION_CHINA:
+            rdata = is_ipv4 ? g_china4 : is_ipv6 ? g_china6 : NULL;
+            break;
+        case ACTION_FOREIGN:
+            rdata = is_ipv4 ? g_foreign4 : is_ipv6 ? g_foreign6 : NULL;
+            break;
+        case ACTION_ADDRESS:
+            if ((is_ipv4 && rule->is_ipv4) || (is_ipv6 && !rule->is_ipv4)) rdata = rule->address;
+            break;
+        case ACTION_NXDOMAIN:
+            rcode = DNS_RCODE_NXDOMAIN;
+            break;
+        case ACTION_SERVFAIL:
+            rcode = DNS_RCODE_SERVFAIL;
+            break;
+    }
+    if (rdata) rdatalen = is_ipv4 ? 4 : 16;
+
+    bool truncated = g_truncate_pct && rand32() % 100 < g_truncate_pct;
+    if (truncated) rdata = NULL;
+
+    packet[2] |= 0x80; /* qr */
+    if (truncated) packet[2] |= 0x02; /* tc */
+    packet[3] = 0x80 | rcode; /* ra */
+    packet[6] = 0; packet[7] = rdata ? 1 : 0; /* ancount */
+    packet[8] = 0; packet[9] = 0;  /* nscount */
+    packet[10] = 0; packet[11] = 0; /* arcount (the OPT record is dropped) */
+    if (!rdata) return offset;
+
+    uint8_t *rr = packet + offset;
+    rr[0] = 0xc0; rr[1] = DNS_HEADER_LEN; /* name: pointer to the question */
+    rr[2] = qtype >> 8; rr[3] = qtype & 0xff;
+    rr[4] = 0; rr[5] = 1; /* class IN */
+    rr[6] = g_answer_ttl >> 24; rr[7] = g_answer_ttl >> 16; rr[8] = g_answer_ttl >> 8; rr[9] = g_answer_ttl;
+    rr[10] = rdatalen >> 8; rr[11] = rdatalen & 0xff;
+    memcpy(rr + 12, rdata, rdatalen);
+    return offset + 12 + rdatalen;
+}
+
+static void heap_swap(size_t a, size_t b) {
+    pending_t *tmp = g_pending_heap[a];
+    g_pending_heap[a] = g_pending_heap[b];
+    g_pending_heap[b] = tmp;
+}
+
+static void pending_push(pending_t *pending) {
+    size_t i = g_pending_cnt++;
+    g_pending_heap[i] = pending;
+    while (i > 0 && g_pending_heap[(i - 1) / 2]->due_ms > g_pending_heap[i]->due_ms) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static pending_t *pending_pop(void) {
+    pending_t *top = g_pending_heap[0];
+    g_pending_heap[0] = g_pending_heap[--g_pending_cnt];
+    for (size_t i = 0;;) {
+        size_t l = i * 2 + 1, r = l + 1, min = i;
+        if (l < g_pending_cnt && g_pending_heap[l]->due_ms < g_pending_heap[min]->due_ms) min = l;
+        if (r < g_pending_cnt && g_pending_heap[r]->due_ms < g_pending_heap[min]->due_ms) min = r;
+        if (min == i) break;
+        heap_swap(i, min);
+        i = min;
+    }
+    return top;
+}
+
+static void send_due_replies(void) {
+    uint64_t now = now_ms();
+    while (g_pending_cnt > 0 && g_pending_heap[0]->due_ms <= now) {
+        pending_t *pending = pending_pop();
+        sendto(g_sockfd, pending->packet, pending->length, 0, (void *)&pending->addr, pending->addrlen);
+        g_pending_free[PENDING_MAXCOUNT - g_pending_cnt - 1] = pending;
+    }
+}
+
+static void parse_ipaddr(const char *ipstr, uint8_t addr4[4], uint8_t addr6[16]) {
+    if (inet_pton(AF_INET, ipstr, addr4) == 1) return;
+    if (inet_pton(AF_INET6, ipstr, addr6) == 1) return;
+    printf("[parse_args] invalid ip address: %s\n", ipstr);
+    exit(1);
+}
+
+static void parse_args(int argc, char *argv[]) {
+    const struct option options[] = {
+        {"bind-addr",    required_argument, NULL, 'b'},
+        {"bind-port",    required_argument, NULL, 'l'},
+        {"answer4",      required_argument, NULL, 'a'},
+        {"answer6",      required_argument, NULL, 'A'},
+        {"rule-file",    required_argument, NULL, 'r'},
+        {"china-list",   required_argument, NULL, 'C'},
+        {"foreign-list", required_argument, NULL, 'G'},
+        {"china-ip",     required_argument, NULL, 'c'},
+        {"foreign-ip",   required_argument, NULL, 'f'},
+        {"delay-ms",     required_argument, NULL, 'd'},
+        {"jitter-ms",    required_argument, NULL, 'j'},
+        {"loss",         required_argument, NULL, 'L'},
+        {"truncate",     required_argument, NULL, 't'},
+        {"ttl",          required_argument, NULL, 'T'},
+        {"help",         no_argument,       NULL, 'h'},
+        {NULL,           0,                 NULL,  0 },
+    };
+    inet_pton(AF_INET, "114.80.1.1", g_china4);
+    inet_pton(AF_INET6, "2001:250::1", g_china6);
+    inet_pton(AF_INET, "8.8.8.8", g_foreign4);
+    inet_pton(AF_INET6, "2001:4860::8888", g_foreign6);
+    int shortopt;
+    while ((shortopt = getopt_long(argc, argv, "b:l:a:A:r:C:G:c:f:d:j:L:t:T:h", options, NULL)) != -1) {
+        switch (shortopt) {
+            case 'b': g_bind_ipstr = optarg; break;
+            case 'l': g_bind_port = strtoul(optarg, NULL, 10); break;
+            case 'a':
+                if (inet_pton(AF_INET, optarg, g_answer4) != 1) goto BAD_ARG;
+                g_has_answer4 = true;
+                break;
+            case 'A':
+                if (inet_pton(AF_INET6, optarg, g_answer6) != 1) goto BAD_ARG;
+                g_has_answer6 = true;
+                break;
+            case 'r': load_rules(optarg, ACTION_DEFAULT); break;
+            case 'C': load_rules(optarg, ACTION_CHINA); break;
+            case 'G': load_rules(optarg, ACTION_FOREIGN); break;
+            case 'c': parse_ipaddr(optarg, g_china4, g_china6); break;
+            case 'f': parse_ipaddr(optarg, g_foreign4, g_foreign6); break;
+            case 'd': g_delay_ms = strtoul(optarg, NULL, 10); break;
+            case 'j': g_jitter_ms = strtoul(optarg, NULL, 10); break;
+            case 'L': g_loss_pct = strtoul(optarg, NULL, 10); break;
+            case 't': g_truncate_pct = strtoul(optarg, NULL, 10); break;
+            case 'T': g_answer_ttl = strtoul(optarg, NULL, 10); break;
+            case 'h': print_help(); exit(0);
+            default: goto BAD_ARG;
+        }
+    }
+    if (g_loss_pct > 100 || g_truncate_pct > 100) goto BAD_ARG;
+    return;
+BAD_ARG:
+    print_help();
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+
+    struct sockaddr_storage bind_addr = {0};
+    socklen_t bind_addrlen = 0;
+    struct sockaddr_in *addr4 = (void *)&bind_addr;
+    struct sockaddr_in6 *addr6 = (void *)&bind_addr;
+    if (inet_pton(AF_INET, g_bind_ipstr, &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(g_bind_port);
+        bind_addrlen = sizeof(*addr4);
+    } else if (inet_pton(AF_INET6, g_bind_ipstr, &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(g_bind_port);
+        bind_addrlen = sizeof(*addr6);
+    } else {
+        printf("[main] invalid listen ip address: %s\n", g_bind_ipstr);
+        return 1;
+    }
+
+    g_sockfd = socket(bind_addr.ss_family, SOCK_DGRAM, 0);
+    if (g_sockfd < 0 || bind(g_sockfd, (void *)&bind_addr, bind_addrlen)) {
+        printf("[main] failed to bind %s#%hu: (%d) %s\n", g_bind_ipstr, g_bind_port, errno, strerror(errno));
+        return errno;
+    }
+    setsockopt(g_sockfd, SOL_SOCKET, SO_RCVBUF, &(int){4 << 20}, sizeof(int));
+
+    g_pending = malloc(sizeof(pending_t) * PENDING_MAXCOUNT);
+    g_pending_heap = malloc(sizeof(pending_t *) * PENDING_MAXCOUNT);
+    g_pending_free = malloc(sizeof(pending_t *) * PENDING_MAXCOUNT);
+    for (size_t i = 0; i < PENDING_MAXCOUNT; ++i) g_pending_free[i] = &g_pending[PENDING_MAXCOUNT - i - 1];
+
+    printf("[main] listen on %s#%hu, %zu rules, delay: %u+%u ms, loss: %u%%, truncate: %u%%\n",
+           g_bind_ipstr, g_bind_port, g_rule_cnt, g_delay_ms, g_jitter_ms, g_loss_pct, g_truncate_pct);
+    fflush(stdout);
+
+    uint8_t packet[PACKET_MAXSIZE];
+    while (true) {
+        int timeout = -1;
+        if (g_pending_cnt > 0) {
+            uint64_t due = g_pending_heap[0]->due_ms, now = now_ms();
+            timeout = due > now ? (int)(due - now) : 0;
+        }
+        struct pollfd pfd = {.fd = g_sockfd, .events = POLLIN};
+        if (poll(&pfd, 1, timeout) > 0) {
+            struct sockaddr_storage addr;
+            socklen_t addrlen = sizeof(addr);
+            ssize_t length = recvfrom(g_sockfd, packet, sizeof(packet) - 64, 0, (void *)&addr, &addrlen);
+            if (length <= 0 || (g_loss_pct && rand32() % 100 < g_loss_pct)) goto SEND_DUE;
+            int32_t delay_ms = -1;
+            size_t replylen = build_reply(packet, length, &delay_ms);
+            if (replylen == 0) goto SEND_DUE;
+            uint32_t delay = (delay_ms >= 0 ? (uint32_t)delay_ms : g_delay_ms) + (g_jitter_ms ? rand32() % (g_jitter_ms + 1) : 0);
+            if (delay == 0) {
+                sendto(g_sockfd, packet, replylen, 0, (void *)&addr, addrlen);
+            } else if (g_pending_cnt < PENDING_MAXCOUNT) {
+                pending_t *pending = g_pending_free[PENDING_MAXCOUNT - g_pending_cnt - 1];
+                pending->due_ms = now_ms() + delay;
+                pending->addr = addr;
+                pending->addrlen = addrlen;
+                pending->length = replylen;
+                memcpy(pending->packet, packet, replylen);
+                pending_push(pending);
+            }
+        }
+SEND_DUE:
+        send_due_replies();
+    }
+    return 0;
+}
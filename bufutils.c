@@ -0,0 +1,37 @@
+#define _GNU_SOURCE
+#include "bufutils.h"
+#include <stdlib.h>
+#undef _GNU_SOURCE
+
+/* free buffers kept for reuse, the rest are freed */
+#define PKTBUF_POOL_MAXCOUNT 1024
+
+static pktbuf_t *g_pktbuf_pool  = NULL;
+static size_t    g_pktbuf_count = 0;
+
+/* take a buffer from the pool (or allocate one), its refcount is 1 */
+pktbuf_t *pktbuf_new(void) {
+    pktbuf_t *pkt = g_pktbuf_pool;
+    if (pkt) {
+        g_pktbuf_pool = pkt->next;
+        --g_pktbuf_count;
+    } else {
+        pkt = malloc(sizeof(pktbuf_t));
+    }
+    pkt->next = NULL;
+    pkt->refcount = 1;
+    pkt->len = 0;
+    return pkt;
+}
+
+/* drop a reference (NULL is ignored), the buffer goes back to the pool at 0 */
+void pktbuf_unref(pktbuf_t *pkt) {
+    if (!pkt || --pkt->refcount) return;
+    if (g_pktbuf_count >= PKTBUF_POOL_MAXCOUNT) {
+        free(pkt);
+        return;
+    }
+    pkt->next = g_pktbuf_pool;
+    g_pktbuf_pool = pkt;
+    ++g_pktbuf_count;
+}
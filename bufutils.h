@@ -0,0 +1,30 @@
+#ifndef CHINADNS_NG_BUFUTILS_H
+#define CHINADNS_NG_BUFUTILS_H
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include "dnsutils.h"
+#undef _GNU_SOURCE
+
+/* refcounted packet buffer, shared by the query contexts and the send queues instead of copied */
+typedef struct pktbuf {
+    struct pktbuf *next;     /* free list link */
+    uint32_t       refcount;
+    uint16_t       len;      /* length of the packet in `data` */
+    char           data[DNS_PACKET_MAXSIZE];
+} pktbuf_t;
+
+/* take a buffer from the pool (or allocate one), its refcount is 1 */
+pktbuf_t *pktbuf_new(void);
+
+/* drop a reference (NULL is ignored), the buffer goes back to the pool at 0 */
+void pktbuf_unref(pktbuf_t *pkt);
+
+/* take a reference */
+static inline pktbuf_t *pktbuf_ref(pktbuf_t *pkt) {
+    ++pkt->refcount;
+    return pkt;
+}
+
+#endif
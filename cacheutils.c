@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include "cacheutils.h"
+#include "dnsutils.h"
+#include "logutils.h"
+#include "realtime.h"
+#include "uthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#undef _GNU_SOURCE
+
+/* cache entry, `ttl_offsets` is followed by the key and the reply */
+typedef struct {
+    myhash_hh hh;
+    uint64_t  store_time;  /* cache_now() when stored */
+    uint32_t  min_ttl;     /* smallest ttl of the records */
+    uint16_t  keylen;
+    uint16_t  replylen;
+    uint16_t  ttlcount;
+    uint16_t  ttl_offsets[];
+} cacheentry_t;
+
+/* cache file: header, then one record per entry (host byte order, 8-byte aligned) */
+#define CACHE_FILE_MAGIC   0x48434443 /* "CDCH" */
+#define CACHE_FILE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+} cachefilehdr_t;
+
+/* followed by `ttl_offsets[ttlcount]`, the key and the reply */
+typedef struct {
+    int64_t  store_walltime; /* wall-clock time when the reply was stored */
+    uint32_t min_ttl;
+    uint16_t keylen;
+    uint16_t replylen;
+    uint16_t ttlcount;
+    uint16_t reserved;
+} cacherecord_t;
+
+#define RECORD_SIZE(ttlcount, keylen, replylen) \
+    ((sizeof(cacherecord_t) + (ttlcount) * sizeof(uint16_t) + (keylen) + (replylen) + 7) & ~(size_t)7)
+
+#define ENTRY_KEY(entry) ((uint8_t *)((entry)->ttl_offsets + (entry)->ttlcount))
+#define ENTRY_REPLY(entry) (ENTRY_KEY(entry) + (entry)->keylen)
+
+static cacheentry_t *g_cache_table    = NULL;
+static size_t        g_cache_capacity = 0;
+
+/* monotonic time in seconds */
+static inline uint64_t cache_now(void) {
+    return GetTime() / 1000;
+}
+
+static inline uint32_t ttl_read(const uint8_t *ptr) {
+    uint32_t ttl;
+    memcpy(&ttl, ptr, sizeof(ttl));
+    return ntohl(ttl);
+}
+
+static inline void ttl_write(uint8_t *ptr, uint32_t ttl) {
+    ttl = htonl(ttl);
+    memcpy(ptr, &ttl, sizeof(ttl));
+}
+
+static void cache_remove(cacheentry_t *entry) {
+    MYHASH_DEL(g_cache_table, entry);
+    free(entry);
+}
+
+/* initialize the answer cache, it holds up to `capacity` replies */
+void cache_init(size_t capacity) {
+    g_cache_capacity = capacity;
+}
+
+/* is the answer cache enabled */
+bool cache_enabled(void) {
+    return g_cache_capacity > 0;
+}
+
+/* find a live entry, expired entries are dropped on the way */
+static cacheentry_t *cache_find(const void *key, size_t keylen, uint32_t *elapsed) {
+    cacheentry_t *entry = NULL;
+    MYHASH_GET(g_cache_table, entry, key, keylen);
+    if (!entry) return NULL;
+    *elapsed = cache_now() - entry->store_time;
+    if (*elapsed >= entry->min_ttl) {
+        cache_remove(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+/* copy the reply cached under `key` into `reply_buf` with the ttls aged, return its length or -1 */
+ssize_t cache_get(const void *key, size_t keylen, void *reply_buf) {
+    uint32_t elapsed = 0;
+    cacheentry_t *entry = cache_find(key, keylen, &elapsed);
+    if (!entry) return -1;
+    uint8_t *reply = reply_buf;
+    memcpy(reply, ENTRY_REPLY(entry), entry->replylen);
+    for (uint16_t i = 0; i < entry->ttlcount; ++i) {
+        uint8_t *ttl_ptr = reply + entry->ttl_offsets[i];
+        ttl_write(ttl_ptr, ttl_read(ttl_ptr) - elapsed); /* every ttl >= min_ttl > elapsed */
+    }
+    return entry->replylen;
+}
+
+/* remaining lifetime (in seconds) of the reply cached under `key`, 0 if not cached */
+uint32_t cache_ttl(const void *key, size_t keylen) {
+    uint32_t elapsed = 0;
+    cacheentry_t *entry = cache_find(key, keylen, &elapsed);
+    return entry ? entry->min_ttl - elapsed : 0;
+}
+
+/* add an entry (replacing the one with the same key), the oldest one is evicted if the cache is full */
+static void cache_insert(const void *key, size_t keylen, const void *reply_buf, size_t reply_len, const uint16_t *ttl_offsets, uint16_t ttlcount, uint32_t min_ttl) {
+    cacheentry_t *entry = NULL;
+    MYHASH_GET(g_cache_table, entry, key, keylen);
+    if (entry) {
+        cache_remove(entry);
+    } else if (MYHASH_CNT(g_cache_table) >= g_cache_capacity) {
+        cache_remove(g_cache_table); /* the head is the oldest entry */
+    }
+
+    entry = malloc(sizeof(cacheentry_t) + ttlcount * sizeof(uint16_t) + keylen + reply_len);
+    entry->store_time = cache_now();
+    entry->min_ttl = min_ttl;
+    entry->keylen = keylen;
+    entry->replylen = reply_len;
+    entry->ttlcount = ttlcount;
+    memcpy(entry->ttl_offsets, ttl_offsets, ttlcount * sizeof(uint16_t));
+    memcpy(ENTRY_KEY(entry), key, keylen);
+    memcpy(ENTRY_REPLY(entry), reply_buf, reply_len);
+    MYHASH_ADD(g_cache_table, entry, ENTRY_KEY(entry), keylen);
+}
+
+/* store a checked reply and its ttl offsets (from dns_ttl_offsets) under `key` (ignored if it is truncated, an error or without ttl) */
+void cache_put(const void *key, size_t keylen, const void *reply_buf, ssize_t reply_len, const uint16_t *ttl_offsets, int ttlcount) {
+    if (!g_cache_capacity || keylen > CACHE_KEY_MAXLEN || ttlcount <= 0 || ttlcount > CACHE_TTL_MAXCOUNT) return;
+    const dns_header_t *header = reply_buf;
+    if (header->tc || (header->rcode != DNS_RCODE_NOERROR && header->rcode != DNS_RCODE_NXDOMAIN)) return;
+
+    uint32_t min_ttl = UINT32_MAX;
+    for (int i = 0; i < ttlcount; ++i) {
+        uint32_t ttl = ttl_read((const uint8_t *)reply_buf + ttl_offsets[i]);
+        if (ttl < min_ttl) min_ttl = ttl;
+    }
+    if (min_ttl == 0) return;
+    cache_insert(key, keylen, reply_buf, reply_len, ttl_offsets, ttlcount, min_ttl);
+}
+
+/* write the live entries to `fname` (via a temporary file), return the count written or -1 */
+ssize_t cache_dump(const char *fname) {
+    char tmp_fname[strlen(fname) + sizeof(".tmp")];
+    sprintf(tmp_fname, "%s.tmp", fname);
+    FILE *fp = fopen(tmp_fname, "wb");
+    if (!fp) {
+        LOGERR("[cache_dump] failed to open '%s': (%d) %s", tmp_fname, errno, strerror(errno));
+        return -1;
+    }
+
+    cachefilehdr_t header = {CACHE_FILE_MAGIC, CACHE_FILE_VERSION, 0};
+    fwrite(&header, sizeof(header), 1, fp);
+    uint64_t now = cache_now();
+    int64_t walltime = GetWallTime();
+    static const uint8_t padding[8] = {0};
+    cacheentry_t *entry = NULL, *tmp = NULL;
+    MYHASH_FOR(g_cache_table, entry, tmp) {
+        uint64_t elapsed = now - entry->store_time;
+        if (elapsed >= entry->min_ttl) continue;
+        cacherecord_t record = {walltime - (int64_t)elapsed, entry->min_ttl, entry->keylen, entry->replylen, entry->ttlcount, 0};
+        size_t data_len = entry->ttlcount * sizeof(uint16_t) + entry->keylen + entry->replylen; /* contiguous in the entry */
+        fwrite(&record, sizeof(record), 1, fp);
+        fwrite(entry->ttl_offsets, data_len, 1, fp);
+        fwrite(padding, RECORD_SIZE(entry->ttlcount, entry->keylen, entry->replylen) - sizeof(record) - data_len, 1, fp);
+        ++header.count;
+    }
+    rewind(fp);
+    fwrite(&header, sizeof(header), 1, fp); /* the final count */
+
+    bool failed = ferror(fp);
+    if (fclose(fp)) failed = true;
+    if (failed || rename(tmp_fname, fname)) {
+        LOGERR("[cache_dump] failed to write '%s': (%d) %s", fname, errno, strerror(errno));
+        unlink(tmp_fname);
+        return -1;
+    }
+    return header.count;
+}
+
+/* load the entries dumped to `fname`, ttls are rebased on the wall-clock time, return the count loaded */
+size_t cache_load(const char *fname) {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) LOGERR("[cache_load] failed to open '%s': (%d) %s", fname, errno, strerror(errno));
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(cachefilehdr_t)) {
+        close(fd);
+        return 0;
+    }
+    size_t file_len = st.st_size;
+    const uint8_t *file_buf = mmap(NULL, file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file_buf == MAP_FAILED) {
+        LOGERR("[cache_load] failed to mmap '%s': (%d) %s", fname, errno, strerror(errno));
+        return 0;
+    }
+
+    size_t loaded = 0;
+    const cachefilehdr_t *header = (const cachefilehdr_t *)file_buf;
+    if (header->magic != CACHE_FILE_MAGIC || header->version != CACHE_FILE_VERSION) {
+        LOGERR("[cache_load] '%s' is not a cache file of this version, ignored", fname);
+        goto UNMAP;
+    }
+    int64_t walltime = GetWallTime();
+    uint8_t reply_buf[DNS_PACKET_MAXSIZE];
+    size_t offset = sizeof(cachefilehdr_t);
+    for (uint64_t i = 0; i < header->count && loaded < g_cache_capacity; ++i) {
+        if (file_len - offset < sizeof(cacherecord_t)) break;
+        const cacherecord_t *record = (const cacherecord_t *)(file_buf + offset);
+        size_t record_size = RECORD_SIZE(record->ttlcount, record->keylen, record->replylen);
+        if (file_len - offset < record_size || record->ttlcount > CACHE_TTL_MAXCOUNT ||
+            record->keylen > CACHE_KEY_MAXLEN || record->replylen > DNS_PACKET_MAXSIZE) break; /* truncated or corrupted */
+        offset += record_size;
+
+        int64_t elapsed = walltime - record->store_walltime;
+        if (elapsed < 0) elapsed = 0; /* the clock went backwards */
+        if (elapsed >= record->min_ttl) continue;
+
+        const uint16_t *ttl_offsets = (const uint16_t *)(record + 1);
+        const uint8_t *key = (const uint8_t *)(ttl_offsets + record->ttlcount);
+        memcpy(reply_buf, key + record->keylen, record->replylen);
+        bool valid = true;
+        for (uint16_t j = 0; j < record->ttlcount; ++j) {
+            if (ttl_offsets[j] + sizeof(uint32_t) > record->replylen) valid = false;
+        }
+        if (!valid) continue;
+        for (uint16_t j = 0; j < record->ttlcount; ++j) {
+            uint8_t *ttl_ptr = reply_buf + ttl_offsets[j];
+            ttl_write(ttl_ptr, ttl_read(ttl_ptr) - elapsed); /* rebase: as if it was stored just now */
+        }
+        cache_insert(key, record->keylen, reply_buf, record->replylen, ttl_offsets, record->ttlcount, record->min_ttl - elapsed);
+        ++loaded;
+    }
+UNMAP:
+    munmap((void *)file_buf, file_len);
+    return loaded;
+}
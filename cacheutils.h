@@ -0,0 +1,38 @@
+#ifndef CHINADNS_NG_CACHEUTILS_H
+#define CHINADNS_NG_CACHEUTILS_H
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#undef _GNU_SOURCE
+
+/* cache key max length: question (name + qtype + qclass), edns key and client subnet */
+#define CACHE_KEY_MAXLEN 300
+
+/* max count of ttl fields in a cached reply (larger replies are not cached) */
+#define CACHE_TTL_MAXCOUNT 64
+
+/* initialize the answer cache, it holds up to `capacity` replies */
+void cache_init(size_t capacity);
+
+/* is the answer cache enabled */
+bool cache_enabled(void);
+
+/* copy the reply cached under `key` into `reply_buf` with the ttls aged, return its length or -1 */
+ssize_t cache_get(const void *key, size_t keylen, void *reply_buf);
+
+/* remaining lifetime (in seconds) of the reply cached under `key`, 0 if not cached */
+uint32_t cache_ttl(const void *key, size_t keylen);
+
+/* store a checked reply and its ttl offsets (from dns_ttl_offsets) under `key` (ignored if it is truncated, an error or without ttl) */
+void cache_put(const void *key, size_t keylen, const void *reply_buf, ssize_t reply_len, const uint16_t *ttl_offsets, int ttlcount);
+
+/* write the live entries to `fname` (via a temporary file), return the count written or -1 */
+ssize_t cache_dump(const char *fname);
+
+/* load the entries dumped to `fname`, ttls are rebased on the wall-clock time, return the count loaded */
+size_t cache_load(const char *fname);
+
+#endif
@@ -4,11 +4,19 @@
 #include "netutils.h"
 #include "dnsutils.h"
 #include "dnlutils.h"
+#include "taputils.h"
+#include "cacheutils.h"
+#include "prefetchutils.h"
+#include "verdictutils.h"
+#include "limitutils.h"
+#include "bufutils.h"
 #include "uthash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <time.h>
 #include <errno.h>
@@ -23,13 +31,24 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <err.h>
+#if defined(__FreeBSD__)
+  #include <sys/param.h>
+  #include <sys/cpuset.h>
+#elif defined(__linux__)
+  #include <sched.h>
+#endif
 
 /* limits.h */
 #ifndef PATH_MAX
   #define PATH_MAX 4096
 #endif
 
-/* left-16-bit:MSGID; right-16-bit:IDX/MARK */
+/* cpuset.h/sched.h (not available elsewhere, set_cpu_affinity reports it) */
+#ifndef CPU_SETSIZE
+  #define CPU_SETSIZE 1024
+#endif
+
+/* left-16-bit:POOL-SLOT; right-16-bit:IDX/MARK */
 #define CHINADNS1_IDX 0
 #define CHINADNS2_IDX 1
 #define TRUSTDNS1_IDX 2
@@ -42,6 +61,8 @@
 /* constant macro definition */
 #define EPOLL_MAXEVENTS 8
 #define SERVER_MAXCOUNT 4
+#define SOCKPOOL_MAXSIZE 16 /* sockets per upstream server */
+#define MSGBATCH_MAXSIZE 64 /* datagrams per recvmmsg()/sendmmsg() */
 #define SOCKBUFF_MAXSIZE DNS_PACKET_MAXSIZE
 #define PORTSTR_MAXLEN 6 /* "65535\0" (including '\0') */
 #define ADDRPORT_STRLEN (INET6_ADDRSTRLEN + PORTSTR_MAXLEN) /* "addr#port\0" */
@@ -50,28 +71,131 @@
 /* is enable verbose logging */
 #define IF_VERBOSE if (g_verbose)
 
+/* long-only options (getopt_long val) */
+#define OPT_LOG_FORMAT 256
+#define OPT_TAP_FILE   257
+#define OPT_TAP_SAMPLE 258
+#define OPT_TAP_DOMAIN 259
+#define OPT_CHINA_ECS  260
+#define OPT_TRUST_ECS  261
+#define OPT_EDNS_SIZE  262
+#define OPT_CACHE_SIZE 263
+#define OPT_PREFETCH_COUNT 264
+#define OPT_PREFETCH_FILE  265
+#define OPT_CACHE_FILE 266
+#define OPT_RATELIMIT  267
+#define OPT_RRL        268
+#define OPT_SOCK_POOL  269
+#define OPT_RCVBUF     270
+#define OPT_SNDBUF     271
+#define OPT_STATS_INTERVAL 272
+#define OPT_BUSY_POLL  273
+#define OPT_CPU_AFFINITY 274
+#define OPT_BATCH_SIZE 275
+#define OPT_MIN_TTL    276
+#define OPT_MAX_TTL    277
+#define OPT_RULE_FILE  278
+#define OPT_VERDICT_SIZE 279
+
+/* trust-dns repeats are spaced 20, 40, 80.. ms apart (sent at 0, 20, 60, 140.. ms) */
+#define REPEAT_INTERVAL_MS 20
+#define REPEAT_MAX_SHIFT   10 /* the spacing stops doubling at 20 << 10 ms, beyond any upstream timeout */
+
+/* popular names are re-resolved every N seconds */
+#define PREFETCH_INTERVAL_SEC 10
+
+/* learned verdict scores are halved every N seconds */
+#define VERDICT_DECAY_SEC 600
+
+/* ttl of the fixed answers of the routing rules */
+#define RULE_ANSWER_TTL 300
+
+/* longest blocking wait of the event loop (signals are also checked this often) */
+#define EVENT_WAIT_MAXMS 1000
+
+/* the answer cache is dumped every N seconds (and at shutdown) */
+#define CACHE_DUMP_INTERVAL_SEC 300
+
+/* edns client subnet mode (per upstream group) */
+#define ECS_MODE_KEEP   0 /* forward the client's option as-is */
+#define ECS_MODE_STRIP  1 /* remove the client's option */
+#define ECS_MODE_FIXED  2 /* use the configured subnet */
+#define ECS_MODE_CLIENT 3 /* use the subnet of the client address */
+#define ECS_PREFIX4_DEFAULT 24
+#define ECS_PREFIX6_DEFAULT 56
+
+/* edns client subnet option */
+typedef struct {
+    uint8_t    mode;          /* ECS_MODE_* */
+    uint8_t    prefix;        /* source prefix length (ECS_MODE_FIXED) */
+    int        family;        /* AF_INET or AF_INET6 (ECS_MODE_FIXED) */
+    uint8_t    addr[IPV6_BINADDR_LEN];
+} ecsopt_t;
+
+/* running counters, logged every --stats-interval seconds and on SIGUSR1 */
+typedef struct {
+    uint64_t   queries;       /* queries received from the clients */
+    uint64_t   ratelimited;   /* queries dropped by --ratelimit */
+    uint64_t   rrl_truncated; /* queries answered with an empty truncated reply by --rrl */
+    uint64_t   cache_hits;    /* queries answered from the cache */
+    uint64_t   learned;       /* unlisted queries routed by a learned verdict */
+    uint64_t   replies;       /* queries answered from the upstreams */
+    uint64_t   truncated;     /* replies truncated to the client's udp size */
+    uint64_t   timeouts;      /* queries without an acceptable reply in time */
+    uint64_t   dropped;       /* upstream replies dropped before parsing (late, duplicate, spoofed) */
+} stats_t;
+
+/* datagrams of one recvmmsg() or sendmmsg(), the packets are referenced, not copied */
+typedef struct {
+    unsigned       count;         /* queued datagrams (sending side) */
+    struct mmsghdr msgs[MSGBATCH_MAXSIZE];
+    struct iovec   iovs[MSGBATCH_MAXSIZE][2]; /* [0]: header (patched copy) or whole packet, [1]: rest of the packet */
+    skaddr6_t      addrs[MSGBATCH_MAXSIZE];
+    dns_header_t   headers[MSGBATCH_MAXSIZE]; /* patched header copies */
+    pktbuf_t      *pkts[MSGBATCH_MAXSIZE];
+} msgbatch_t;
+
+/* china/trust race and trust-dns repeat state (not allocated for single-upstream queries) */
+typedef struct {
+    pktbuf_t  *trustdns_pkt;  /* [value] reply from trust-dns, held until china-dns answers */
+    pktbuf_t  *repeat_pkt;    /* [value] trust-dns query kept for the spaced repeats */
+    uint8_t    repeat_sent;   /* [value] copies of the trust-dns query sent so far */
+    htimer_t    repeat_timer;
+    bool       chinadns_got;  /* [value] received reply from china-dns */
+} racectx_t;
+
 /* dns query context structure */
 typedef struct {
     uint16_t   unique_msgid;  /* [key] globally unique msgid */
     uint16_t   origin_msgid;  /* [value] associated original msgid */
     htimer_t    query_timer;
     // int        query_timerfd; /* [value] dns query timeout timer-fd */
-    void      *trustdns_buf;  /* [value] storage reply from trust-dns */
-    bool       chinadns_got;  /* [value] received reply from china-dns */
+    racectx_t *race;          /* [value] follows the context, NULL: one upstream group, first reply wins */
     uint8_t    dnlmatch_ret;  /* [value] dnl_ismatch(dname) ret-value */
+    bool       tap_sampled;   /* [value] write tap records for this query */
+    uint64_t   query_time;    /* [value] GetTimeUs() when the query was received */
+    uint16_t   reply_maxlen;  /* [value] largest reply the client accepts over udp */
+    uint32_t   question_hash; /* [value] dns_question_hash() of the query, checked against replies */
+    bool       is_prefetch;   /* [value] issued by prefetch, no client to answer */
+    bool       is_learned;    /* [value] routed by a learned verdict (`dnlmatch_ret` set from it) */
+    uint8_t    edns_keylen;   /* [value] length of `edns_key` */
+    uint8_t    edns_key[DNS_EDNS_KEY_MAXLEN]; /* [value] build_edns_key() of the client's query, part of the cache key */
     skaddr6_t  source_addr;   /* [value] associated client socket addr */
     myhash_hh  hh;            /* [metadata] used internally by `uthash` */
 } queryctx_t;
 
-uint64_t realtime;
-
 /* static global variable declaration */
 static bool        g_verbose                                          = false;
+static int         g_log_format                                       = LOG_FORMAT_TEXT;
+static const char *g_tap_fname                                        = NULL; /* tap file or unix:<path> */
+static uint32_t    g_tap_sample_rate                                  = 1; /* tap 1 query out of N */
+static const char *g_tap_domain                                       = NULL; /* tap this domain suffix only */
 static bool        g_reuse_port                                       = false;
 static bool        g_fair_mode                                        = false; /* default: fast-mode */
 static uint8_t     g_repeat_times                                     = 1; /* used by trust-dns only */
 static const char *g_gfwlist_fname                                    = NULL; /* gfwlist dnamelist filename */
 static const char *g_chnlist_fname                                    = NULL; /* chnlist dnamelist filename */
+static const char *g_rule_fname                                       = NULL; /* routing rules filename */
 static bool        g_gfwlist_first                                    = true; /* match gfwlist dnamelist first */
 static bool        g_no_ipv6_query                                    = false; /* disable ip6-addr query (AAAA) */
        bool        g_noip_as_chnip                                    = false; /* default: see as not-china-ip */
@@ -82,17 +206,55 @@ static portno_t    g_bind_portno                                      = 65353;
 static skaddr6_t   g_bind_skaddr                                      = {0};
 static int         g_bind_sockfd                                      = -1;
 static event_io_t  g_bind_sockfd_event;  
-static int         g_remote_sockfds[SERVER_MAXCOUNT]                  = {-1, -1, -1, -1};
-static event_io_t  g_remote_sockfds_events[SERVER_MAXCOUNT];  
+static int         g_remote_sockfds[SERVER_MAXCOUNT][SOCKPOOL_MAXSIZE]; /* [0] < 0: server not in use */
+static event_io_t  g_remote_sockfds_events[SERVER_MAXCOUNT][SOCKPOOL_MAXSIZE];
+static uint8_t     g_sockpool_size                                    = 1; /* sockets per upstream server */
 static char        g_remote_ipports[SERVER_MAXCOUNT][ADDRPORT_STRLEN] = {"114.114.114.114#53", "", "8.8.8.8#53", ""};
 static skaddr6_t   g_remote_skaddrs[SERVER_MAXCOUNT]                  = {{0}};
-static char        g_socket_buffer[SOCKBUFF_MAXSIZE]                  = {0};
+static pktbuf_t   *g_socket_packet                                    = NULL; /* the packet being handled */
+static ecsopt_t    g_chinadns_ecs                                     = {0}; /* ecs of china-dns queries */
+static ecsopt_t    g_trustdns_ecs                                     = {0}; /* ecs of trust-dns queries */
+static uint16_t    g_edns_udpsize                                     = 0; /* 0: forward the client's size */
+static uint32_t    g_min_ttl                                          = 0; /* ttl floor of the forwarded replies */
+static uint32_t    g_max_ttl                                          = 0; /* ttl cap of the forwarded replies, 0: none */
+static size_t      g_cache_size                                       = 0; /* 0: answer cache disabled */
+static const char *g_cache_fname                                      = NULL; /* answer cache dump filename */
+static htimer_t    g_cache_dump_timer;
+static ratelimit_t *g_ratelimit                                      = NULL; /* queries per client prefix */
+static ratelimit_t *g_rrl                                            = NULL; /* answers per client prefix and question */
+static uint32_t    g_ratelimit_qps                                    = 0; /* 0: unlimited */
+static uint32_t    g_ratelimit_burst                                  = 0; /* default: 2 * qps */
+static uint32_t    g_rrl_rps                                          = 0; /* 0: unlimited */
+static size_t      g_prefetch_count                                   = 0; /* 0: prefetch disabled */
+static const char *g_prefetch_fname                                   = NULL; /* popularity table filename */
+static htimer_t    g_prefetch_timer;
+static size_t      g_verdict_size                                     = 0; /* 0: verdict learning disabled */
+static htimer_t    g_verdict_timer;
+static int         g_socket_rcvbuf                                    = 0; /* 0: the system default */
+static int         g_socket_sndbuf                                    = 0; /* 0: the system default */
+static time_t      g_stats_interval_sec                               = 0; /* 0: only on SIGUSR1 */
+static htimer_t    g_stats_timer;
+static stats_t     g_stats                                            = {0};
+static uint64_t    g_kernel_drops_base                                = 0; /* kernel drop counter at startup */
+static uint32_t    g_busy_poll_usec                                   = 0; /* 0: block when there is nothing to do */
+static int         g_cpu_affinity                                     = -1; /* -1: not pinned */
+static uint8_t     g_batch_size                                       = 1; /* 1: one sendto() per datagram */
+static msgbatch_t  g_rxbatch; /* datagrams received by one recvmmsg() (any socket, handled at once) */
+static msgbatch_t  g_local_txbatch; /* replies to the clients, sent by one sendmmsg() */
+static msgbatch_t  g_remote_txbatches[SERVER_MAXCOUNT]; /* queries to each upstream, sent by one sendmmsg() */
 static time_t      g_upstream_timeout_sec                             = 5;
-static uint16_t    g_current_unique_msgid                             = 0;
+static uint16_t    g_current_unique_msgid                             = 0; /* counter, permuted by msgid_permute() */
+static uint32_t    g_msgid_keys[4]                                    = {0}; /* msgid permutation round keys */
 static queryctx_t *g_query_context_hashtbl                            = NULL;
 static char        g_domain_name_buffer[DNS_DOMAIN_NAME_MAXLEN]       = {0};
 static char        g_ipaddrstring_buffer[INET6_ADDRSTRLEN]            = {0};
 
+/* set by the SIGTERM/SIGINT handler */
+static volatile sig_atomic_t g_shutdown_signal = 0;
+
+/* set by the SIGUSR1 handler */
+static volatile sig_atomic_t g_stats_signal = 0;
+
 /* print command help information */
 static void print_command_help(void) {
     printf("usage: chinadns-ng <options...>. the existing options are as follows:\n"
@@ -112,6 +274,30 @@ static void print_command_help(void) {
            " -r, --reuse-port                     enable SO_REUSEPORT, default: <disabled>\n"
            " -n, --noip-as-chnip                  accept reply without ipaddr (A/AAAA query)\n"
            " -v, --verbose                        print the verbose log, default: <disabled>\n"
+           "     --log-format <text|json>         format of the log lines, default: text\n"
+           "     --rule-file <file-path>          domain rules: china, trust, block, ip[,ip]\n"
+           "     --tap-file <path|unix:path>      write binary query records to file/socket\n"
+           "     --tap-sample <N>                 tap one query out of every N, default: 1\n"
+           "     --tap-domain <domain-suffix>     only tap queries under the domain suffix\n"
+           "     --china-ecs <subnet|client|none> edns client subnet (ip[/len]) to china dns\n"
+           "     --trust-ecs <subnet|client|none> edns client subnet (ip[/len]) to trust dns\n"
+           "     --edns-size <size>               edns udp payload size, range: 512-4096\n"
+           "     --min-ttl <sec>                  min ttl of the forwarded replies, default: 0\n"
+           "     --max-ttl <sec>                  max ttl of the forwarded replies, default: <none>\n"
+           "     --cache-size <N>                 cache up to N replies, default: 0 (disabled)\n"
+           "     --cache-file <file-path>         dump/restore the answer cache to/from file\n"
+           "     --ratelimit <qps[/burst]>        limit the queries of each client /24 or /56\n"
+           "     --rrl <rps>                      limit identical answers to each client /24 or /56\n"
+           "     --sock-pool <K>                  random-port sockets per upstream, default: 1\n"
+           "     --rcvbuf <bytes>                 SO_RCVBUF of the sockets, default: <system>\n"
+           "     --sndbuf <bytes>                 SO_SNDBUF of the sockets, default: <system>\n"
+           "     --stats-interval <sec>           log the counters every N sec (and on SIGUSR1)\n"
+           "     --busy-poll <usec>               spin for N usec after the last packet, then block\n"
+           "     --cpu-affinity <cpu>             pin the process to the cpu (for --busy-poll)\n"
+           "     --batch-size <N>                 datagrams per recvmmsg/sendmmsg, default: 1\n"
+           "     --prefetch-count <N>             keep N popular list-matched names cached\n"
+           "     --prefetch-file <file-path>      save/load the name popularity to/from file\n"
+           "     --verdict-size <N>               learn china/foreign of N unlisted domains\n"
            " -V, --version                        print `chinadns-ng` version number and exit\n"
            " -h, --help                           print `chinadns-ng` help information and exit\n"
            "bug report: https://github.com/zfl9/chinadns-ng. email: zfl9.com@gmail.com (Otokaze)\n"
@@ -159,6 +345,41 @@ PRINT_HELP_AND_EXIT:
     exit(1);
 }
 
+/* parse and check ecs option: "client", "none", "ip" or "ip/prefix" */
+static void parse_ecs_opt(char *option_argval, ecsopt_t *ecsopt) {
+    if (!strcmp(option_argval, "client")) {
+        ecsopt->mode = ECS_MODE_CLIENT;
+        return;
+    }
+    if (!strcmp(option_argval, "none")) {
+        ecsopt->mode = ECS_MODE_STRIP;
+        return;
+    }
+    char *slash_ptr = strchr(option_argval, '/');
+    if (slash_ptr) *slash_ptr++ = 0;
+    ecsopt->family = get_ipstr_family(option_argval);
+    if (ecsopt->family == -1) {
+        printf("[parse_ecs_opt] invalid subnet ip address: %s\n", option_argval);
+        goto PRINT_HELP_AND_EXIT;
+    }
+    unsigned prefix_max = ecsopt->family == AF_INET ? 32 : 128;
+    unsigned prefix = ecsopt->family == AF_INET ? ECS_PREFIX4_DEFAULT : ECS_PREFIX6_DEFAULT;
+    if (slash_ptr) {
+        prefix = strtoul(slash_ptr, NULL, 10);
+        if (prefix == 0 || prefix > prefix_max) {
+            printf("[parse_ecs_opt] invalid subnet prefix length: %s\n", slash_ptr);
+            goto PRINT_HELP_AND_EXIT;
+        }
+    }
+    inet_pton(ecsopt->family, option_argval, ecsopt->addr);
+    ecsopt->prefix = prefix;
+    ecsopt->mode = ECS_MODE_FIXED;
+    return;
+PRINT_HELP_AND_EXIT:
+    print_command_help();
+    exit(1);
+}
+
 /* parse and check command arguments */
 static void parse_command_args(int argc, char *argv[]) {
     const char *optstr = ":b:l:c:t:4:6:g:m:o:p:MNfrnvVh";
@@ -174,11 +395,35 @@ static void parse_command_args(int argc, char *argv[]) {
         {"timeout-sec",   required_argument, NULL, 'o'},
         {"repeat-times",  required_argument, NULL, 'p'},
         {"chnlist-first", no_argument,       NULL, 'M'},
+        {"rule-file",     required_argument, NULL, OPT_RULE_FILE},
         {"no-ipv6",       no_argument,       NULL, 'N'},
         {"fair-mode",     no_argument,       NULL, 'f'},
         {"reuse-port",    no_argument,       NULL, 'r'},
         {"noip-as-chnip", no_argument,       NULL, 'n'},
         {"verbose",       no_argument,       NULL, 'v'},
+        {"log-format",    required_argument, NULL, OPT_LOG_FORMAT},
+        {"tap-file",      required_argument, NULL, OPT_TAP_FILE},
+        {"tap-sample",    required_argument, NULL, OPT_TAP_SAMPLE},
+        {"tap-domain",    required_argument, NULL, OPT_TAP_DOMAIN},
+        {"china-ecs",     required_argument, NULL, OPT_CHINA_ECS},
+        {"trust-ecs",     required_argument, NULL, OPT_TRUST_ECS},
+        {"edns-size",     required_argument, NULL, OPT_EDNS_SIZE},
+        {"min-ttl",       required_argument, NULL, OPT_MIN_TTL},
+        {"max-ttl",       required_argument, NULL, OPT_MAX_TTL},
+        {"cache-size",    required_argument, NULL, OPT_CACHE_SIZE},
+        {"cache-file",    required_argument, NULL, OPT_CACHE_FILE},
+        {"ratelimit",     required_argument, NULL, OPT_RATELIMIT},
+        {"rrl",           required_argument, NULL, OPT_RRL},
+        {"sock-pool",     required_argument, NULL, OPT_SOCK_POOL},
+        {"rcvbuf",        required_argument, NULL, OPT_RCVBUF},
+        {"sndbuf",        required_argument, NULL, OPT_SNDBUF},
+        {"stats-interval", required_argument, NULL, OPT_STATS_INTERVAL},
+        {"busy-poll",     required_argument, NULL, OPT_BUSY_POLL},
+        {"cpu-affinity",  required_argument, NULL, OPT_CPU_AFFINITY},
+        {"batch-size",    required_argument, NULL, OPT_BATCH_SIZE},
+        {"prefetch-count", required_argument, NULL, OPT_PREFETCH_COUNT},
+        {"verdict-size",  required_argument, NULL, OPT_VERDICT_SIZE},
+        {"prefetch-file", required_argument, NULL, OPT_PREFETCH_FILE},
         {"version",       no_argument,       NULL, 'V'},
         {"help",          no_argument,       NULL, 'h'},
         {NULL,            0,                 NULL,  0 },
@@ -246,6 +491,13 @@ static void parse_command_args(int argc, char *argv[]) {
                 }
                 g_chnlist_fname = optarg;
                 break;
+            case OPT_RULE_FILE:
+                if (strlen(optarg) + 1 > PATH_MAX) {
+                    printf("[parse_command_args] file path max length is 4095: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_rule_fname = optarg;
+                break;
             case 'o':
                 g_upstream_timeout_sec = strtoul(optarg, NULL, 10);
                 if (g_upstream_timeout_sec <= 0) {
@@ -278,6 +530,162 @@ static void parse_command_args(int argc, char *argv[]) {
             case 'v':
                 g_verbose = true;
                 break;
+            case OPT_LOG_FORMAT:
+                if (!strcmp(optarg, "text")) {
+                    g_log_format = LOG_FORMAT_TEXT;
+                } else if (!strcmp(optarg, "json")) {
+                    g_log_format = LOG_FORMAT_JSON;
+                } else {
+                    printf("[parse_command_args] invalid log format (text|json): %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                break;
+            case OPT_TAP_FILE:
+                if (strlen(optarg) + 1 > PATH_MAX) {
+                    printf("[parse_command_args] file path max length is 4095: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_tap_fname = optarg;
+                break;
+            case OPT_TAP_SAMPLE:
+                g_tap_sample_rate = strtoul(optarg, NULL, 10);
+                if (g_tap_sample_rate == 0) {
+                    printf("[parse_command_args] tap sample rate min value is 1: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                break;
+            case OPT_CHINA_ECS:
+                parse_ecs_opt(optarg, &g_chinadns_ecs);
+                break;
+            case OPT_TRUST_ECS:
+                parse_ecs_opt(optarg, &g_trustdns_ecs);
+                break;
+            case OPT_EDNS_SIZE:
+                if (strtoul(optarg, NULL, 10) < DNS_EDNS_UDPSIZE_MIN || strtoul(optarg, NULL, 10) > DNS_EDNS_UDPSIZE_MAX) {
+                    printf("[parse_command_args] invalid edns udp payload size: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_edns_udpsize = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_MIN_TTL:
+            case OPT_MAX_TTL: {
+                char *endptr = NULL;
+                unsigned long ttl = strtoul(optarg, &endptr, 10);
+                bool is_min = shortopt == OPT_MIN_TTL;
+                if (!isdigit(optarg[0]) || *endptr || (!is_min && ttl == 0) || ttl > INT32_MAX) { /* rfc2181: ttl is 0-2^31-1 */
+                    printf("[parse_command_args] %s ttl range is %d-%d: %s\n", is_min ? "min" : "max", is_min ? 0 : 1, INT32_MAX, optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                *(is_min ? &g_min_ttl : &g_max_ttl) = ttl;
+                break;
+            }
+            case OPT_CACHE_SIZE:
+                g_cache_size = strtoul(optarg, NULL, 10);
+                if (g_cache_size == 0) {
+                    printf("[parse_command_args] cache size min value is 1: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                break;
+            case OPT_CACHE_FILE:
+                if (strlen(optarg) + 1 > PATH_MAX) {
+                    printf("[parse_command_args] file path max length is 4095: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_cache_fname = optarg;
+                break;
+            case OPT_RATELIMIT: {
+                char *slash_ptr = strchr(optarg, '/');
+                unsigned long qps = strtoul(optarg, NULL, 10);
+                unsigned long burst = slash_ptr ? strtoul(slash_ptr + 1, NULL, 10) : qps * 2;
+                if (qps == 0 || burst == 0 || qps > RATELIMIT_MAXRATE || burst > RATELIMIT_MAXRATE) {
+                    printf("[parse_command_args] invalid rate limit (qps[/burst], range: 1-%d): %s\n", RATELIMIT_MAXRATE, optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_ratelimit_qps = qps;
+                g_ratelimit_burst = burst;
+                break;
+            }
+            case OPT_RRL:
+                if (strtoul(optarg, NULL, 10) < 1 || strtoul(optarg, NULL, 10) > RATELIMIT_MAXRATE) {
+                    printf("[parse_command_args] response rate limit range is 1-%d: %s\n", RATELIMIT_MAXRATE, optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_rrl_rps = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_SOCK_POOL:
+                if (strtoul(optarg, NULL, 10) < 1 || strtoul(optarg, NULL, 10) > SOCKPOOL_MAXSIZE) {
+                    printf("[parse_command_args] socket pool size range is 1-%d: %s\n", SOCKPOOL_MAXSIZE, optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_sockpool_size = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_RCVBUF:
+            case OPT_SNDBUF:
+                if (strtoul(optarg, NULL, 10) == 0 || strtoul(optarg, NULL, 10) > INT32_MAX) {
+                    printf("[parse_command_args] invalid socket buffer size: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                *(shortopt == OPT_RCVBUF ? &g_socket_rcvbuf : &g_socket_sndbuf) = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_BUSY_POLL:
+                g_busy_poll_usec = strtoul(optarg, NULL, 10);
+                if (g_busy_poll_usec == 0 || g_busy_poll_usec > 1000000) {
+                    printf("[parse_command_args] busy poll range is 1-1000000 usec: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                break;
+            case OPT_CPU_AFFINITY: {
+                char *endptr = NULL;
+                long cpu = strtol(optarg, &endptr, 10);
+                if (!isdigit(optarg[0]) || *endptr || cpu >= CPU_SETSIZE) {
+                    printf("[parse_command_args] cpu number range is 0-%d: %s\n", CPU_SETSIZE - 1, optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_cpu_affinity = cpu;
+                break;
+            }
+            case OPT_BATCH_SIZE:
+                if (strtoul(optarg, NULL, 10) < 1 || strtoul(optarg, NULL, 10) > MSGBATCH_MAXSIZE) {
+                    printf("[parse_command_args] batch size range is 1-%d: %s\n", MSGBATCH_MAXSIZE, optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_batch_size = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_STATS_INTERVAL:
+                g_stats_interval_sec = strtoul(optarg, NULL, 10);
+                if (g_stats_interval_sec == 0) {
+                    printf("[parse_command_args] stats interval min value is 1: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                break;
+            case OPT_PREFETCH_COUNT:
+                g_prefetch_count = strtoul(optarg, NULL, 10);
+                if (g_prefetch_count == 0) {
+                    printf("[parse_command_args] prefetch count min value is 1: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                break;
+            case OPT_VERDICT_SIZE:
+                g_verdict_size = strtoul(optarg, NULL, 10);
+                if (g_verdict_size == 0) {
+                    printf("[parse_command_args] verdict size min value is 1: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                break;
+            case OPT_PREFETCH_FILE:
+                if (strlen(optarg) + 1 > PATH_MAX) {
+                    printf("[parse_command_args] file path max length is 4095: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_prefetch_fname = optarg;
+                break;
+            case OPT_TAP_DOMAIN:
+                if (strlen(optarg) + 1 > DNS_DOMAIN_NAME_MAXLEN) {
+                    printf("[parse_command_args] domain name max length is 253: %s\n", optarg);
+                    goto PRINT_HELP_AND_EXIT;
+                }
+                g_tap_domain = optarg;
+                break;
             case 'V':
                 printf(CHINADNS_VERSION"\n");
                 exit(0);
@@ -304,6 +712,18 @@ static void parse_command_args(int argc, char *argv[]) {
         printf("[parse_command_args] gfwlist:%s and chnlist:%s are both STDIN\n", g_gfwlist_fname, g_chnlist_fname);
         goto PRINT_HELP_AND_EXIT;
     }
+    if (g_max_ttl && g_min_ttl > g_max_ttl) {
+        printf("[parse_command_args] min ttl %u is greater than max ttl %u\n", g_min_ttl, g_max_ttl);
+        goto PRINT_HELP_AND_EXIT;
+    }
+    if (g_cache_fname && !g_cache_size) {
+        printf("[parse_command_args] cache file requires the answer cache (--cache-size)\n");
+        goto PRINT_HELP_AND_EXIT;
+    }
+    if (g_prefetch_count && (!g_cache_size || (!g_gfwlist_fname && !g_chnlist_fname && !g_rule_fname))) {
+        printf("[parse_command_args] prefetch requires the answer cache and gfwlist/chnlist\n");
+        goto PRINT_HELP_AND_EXIT;
+    }
 
     build_socket_addr(get_ipstr_family(g_bind_ipstr), &g_bind_skaddr, g_bind_ipstr, g_bind_portno);
     if (chinadns_optarg) {
@@ -327,6 +747,429 @@ PRINT_HELP_AND_EXIT:
 }
 
 
+/* write a tap record for the query if it was sampled */
+static inline void tap_query_event(const queryctx_t *context, uint8_t verdict, uint8_t upstream, const char *dname) {
+    if (!context->tap_sampled) return;
+    tap_write(verdict, upstream, context->dnlmatch_ret, context->unique_msgid, GetTimeUs() - context->query_time, dname);
+}
+
+/* describe an ecs option for the startup log */
+static const char *ecs_mode_string(const ecsopt_t *ecsopt) {
+    static char buffer[INET6_ADDRSTRLEN + 8];
+    switch (ecsopt->mode) {
+        case ECS_MODE_STRIP:
+            return "none (removed)";
+        case ECS_MODE_CLIENT:
+            return "subnet of the client";
+        default:
+            inet_ntop(ecsopt->family, ecsopt->addr, buffer, INET6_ADDRSTRLEN);
+            sprintf(buffer + strlen(buffer), "/%hhu", ecsopt->prefix);
+            return buffer;
+    }
+}
+
+/* is the client address routable on the internet (worth sending as ecs) */
+static bool is_global_ipaddr(const skaddr6_t *skaddr) {
+    if (skaddr->sin6_family == AF_INET) {
+        uint32_t addr = ntohl(((const skaddr4_t *)skaddr)->sin_addr.s_addr);
+        return (addr >> 24) != 10 && (addr >> 24) != 127 && (addr >> 20) != 0xac1 /* 172.16/12 */ &&
+               (addr >> 16) != 0xc0a8 /* 192.168/16 */ && (addr >> 16) != 0xa9fe /* 169.254/16 */ &&
+               (addr >> 22) != 0x191 /* 100.64/10 */ && addr != 0;
+    }
+    const uint8_t *addr = skaddr->sin6_addr.s6_addr;
+    return (addr[0] & 0xfe) != 0xfc /* fc00::/7 */ && !(addr[0] == 0xfe && (addr[1] & 0xc0) == 0x80) /* fe80::/10 */ &&
+           !IN6_IS_ADDR_LOOPBACK(&skaddr->sin6_addr) && !IN6_IS_ADDR_UNSPECIFIED(&skaddr->sin6_addr);
+}
+
+/* apply the ecs option of an upstream group to the query in `g_socket_packet`, return a reference to the packet to send */
+static pktbuf_t *build_ecs_query(const ecsopt_t *ecsopt, const skaddr6_t *source_addr) {
+    int family = 0;
+    uint8_t prefix = 0;
+    const void *addr = NULL;
+    switch (ecsopt->mode) {
+        case ECS_MODE_KEEP:
+            return pktbuf_ref(g_socket_packet);
+        case ECS_MODE_FIXED:
+            family = ecsopt->family;
+            prefix = ecsopt->prefix;
+            addr = ecsopt->addr;
+            break;
+        case ECS_MODE_CLIENT:
+            if (!source_addr || !is_global_ipaddr(source_addr)) return pktbuf_ref(g_socket_packet); /* lan client or prefetch: leave it to the upstream */
+            family = source_addr->sin6_family;
+            prefix = family == AF_INET ? ECS_PREFIX4_DEFAULT : ECS_PREFIX6_DEFAULT;
+            addr = family == AF_INET ? (const void *)&((const skaddr4_t *)source_addr)->sin_addr : (const void *)&source_addr->sin6_addr;
+            break;
+    }
+    pktbuf_t *pkt = pktbuf_new();
+    memcpy(pkt->data, g_socket_packet->data, g_socket_packet->len);
+    ssize_t ecs_packet_len = dns_ecs_rewrite(pkt->data, g_socket_packet->len, SOCKBUFF_MAXSIZE, family, addr, prefix);
+    if (ecs_packet_len < 0) { /* send it unchanged */
+        pktbuf_unref(pkt);
+        return pktbuf_ref(g_socket_packet);
+    }
+    pkt->len = ecs_packet_len;
+    return pkt;
+}
+
+/* edns key of the query (dns_edns_key), the client subnet option counts only if some upstream gets it as-is */
+static size_t build_edns_key(const void *packet_buf, ssize_t packet_len, uint8_t *key_buf) {
+    return dns_edns_key(packet_buf, packet_len, g_chinadns_ecs.mode == ECS_MODE_KEEP || g_trustdns_ecs.mode == ECS_MODE_KEEP, key_buf);
+}
+
+/* cache key: the question (name lowercased), the edns key of the query and, for client subnet ecs, the client's subnet */
+static size_t build_cache_key(const void *packet_buf, ssize_t packet_len, const uint8_t *edns_key, size_t edns_keylen, const skaddr6_t *source_addr, uint8_t *key_buf) {
+    const uint8_t *question = packet_buf + sizeof(dns_header_t);
+    size_t name_len = (const uint8_t *)memchr(question, 0, packet_len - sizeof(dns_header_t)) + 1 - question;
+    for (size_t i = 0; i < name_len; ++i) key_buf[i] = tolower(question[i]);
+    memcpy(key_buf + name_len, question + name_len, sizeof(dns_query_t));
+    size_t key_len = name_len + sizeof(dns_query_t);
+    memcpy(key_buf + key_len, edns_key, edns_keylen);
+    key_len += edns_keylen;
+    if (source_addr && (g_chinadns_ecs.mode == ECS_MODE_CLIENT || g_trustdns_ecs.mode == ECS_MODE_CLIENT) && is_global_ipaddr(source_addr)) {
+        key_buf[key_len++] = source_addr->sin6_family == AF_INET ? 4 : 6;
+        if (source_addr->sin6_family == AF_INET) {
+            memcpy(key_buf + key_len, &((const skaddr4_t *)source_addr)->sin_addr, ECS_PREFIX4_DEFAULT / 8);
+            key_len += ECS_PREFIX4_DEFAULT / 8;
+        } else {
+            memcpy(key_buf + key_len, &source_addr->sin6_addr, ECS_PREFIX6_DEFAULT / 8);
+            key_len += ECS_PREFIX6_DEFAULT / 8;
+        }
+    }
+    return key_len;
+}
+
+/* rate limit key of a client: its /24 or /56 prefix, or the address itself for a lan client */
+static uint64_t client_limit_key(const skaddr6_t *source_addr) {
+    bool is_global = is_global_ipaddr(source_addr);
+    uint64_t hash = RATELIMIT_HASH_INIT;
+    if (source_addr->sin6_family == AF_INET) {
+        hash = ratelimit_hash(hash, &((const skaddr4_t *)source_addr)->sin_addr, is_global ? ECS_PREFIX4_DEFAULT / 8 : IPV4_BINADDR_LEN);
+    } else {
+        hash = ratelimit_hash(hash, &source_addr->sin6_addr, is_global ? ECS_PREFIX6_DEFAULT / 8 : IPV6_BINADDR_LEN);
+    }
+    return hash | 1; /* 0 marks an unused bucket */
+}
+
+/* keyed 16-bit permutation (4-round feistel): unique msgids in an unpredictable order */
+static inline uint16_t msgid_permute(uint16_t counter) {
+    uint8_t left = counter >> 8, right = counter & 0xff;
+    for (int i = 0; i < 4; ++i) {
+        uint8_t round = ((right ^ g_msgid_keys[i]) * 0x9e3779b1U) >> 24;
+        uint8_t next = left ^ round;
+        left = right;
+        right = next;
+    }
+    return (left << 8) | right;
+}
+
+/* point the messages of a batch at its iovecs and addresses */
+static void msgbatch_init(msgbatch_t *batch) {
+    memset(batch, 0, sizeof(*batch));
+    for (int i = 0; i < MSGBATCH_MAXSIZE; ++i) {
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_iov = batch->iovs[i];
+    }
+}
+
+/* give every receiving slot an unshared packet buffer and reset the address lengths */
+static void msgbatch_prepare_recv(msgbatch_t *batch) {
+    for (int i = 0; i < g_batch_size; ++i) {
+        if (batch->pkts[i] && batch->pkts[i]->refcount > 1) { /* held by a query context or a send queue */
+            pktbuf_unref(batch->pkts[i]);
+            batch->pkts[i] = NULL;
+        }
+        if (!batch->pkts[i]) batch->pkts[i] = pktbuf_new();
+        batch->iovs[i][0].iov_base = batch->pkts[i]->data;
+        batch->iovs[i][0].iov_len = SOCKBUFF_MAXSIZE;
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(skaddr6_t);
+    }
+}
+
+/* describe a packet as iovecs: with `header`, the patched header replaces the packet's own */
+static int packet_iovecs(struct iovec *iovs, pktbuf_t *pkt, size_t len, dns_header_t *header) {
+    if (!header) {
+        iovs[0].iov_base = pkt->data;
+        iovs[0].iov_len = len;
+        return 1;
+    }
+    iovs[0].iov_base = header;
+    iovs[0].iov_len = sizeof(dns_header_t);
+    iovs[1].iov_base = pkt->data + sizeof(dns_header_t);
+    iovs[1].iov_len = len - sizeof(dns_header_t);
+    return 2;
+}
+
+/* send the queued datagrams with sendmmsg(), a failed one is logged and skipped */
+static void msgbatch_flush(msgbatch_t *batch, int sockfd, const char *dest_desc) {
+    unsigned sent = 0;
+    while (sent < batch->count) {
+        int count = sendmmsg(sockfd, batch->msgs + sent, batch->count - sent, 0);
+        if (count <= 0) {
+            LOGERR("[msgbatch_flush] failed to send dns packet to %s: (%d) %s", dest_desc, errno, strerror(errno));
+            count = 1;
+        }
+        sent += count;
+    }
+    for (unsigned i = 0; i < batch->count; ++i) {
+        pktbuf_unref(batch->pkts[i]);
+        batch->pkts[i] = NULL;
+    }
+    batch->count = 0;
+}
+
+/* queue a reference to a packet (the batch must not be full) */
+static void msgbatch_push(msgbatch_t *batch, pktbuf_t *pkt, size_t len, const dns_header_t *header, const void *dest_addr, socklen_t dest_addrlen) {
+    unsigned i = batch->count++;
+    batch->pkts[i] = pktbuf_ref(pkt);
+    if (header) batch->headers[i] = *header;
+    batch->msgs[i].msg_hdr.msg_iovlen = packet_iovecs(batch->iovs[i], pkt, len, header ? &batch->headers[i] : NULL);
+    memcpy(&batch->addrs[i], dest_addr, dest_addrlen);
+    batch->msgs[i].msg_hdr.msg_namelen = dest_addrlen;
+}
+
+/* send a packet right away with sendmsg() */
+static ssize_t send_packet(int sockfd, pktbuf_t *pkt, size_t len, dns_header_t *header, const void *dest_addr, socklen_t dest_addrlen) {
+    struct iovec iovs[2];
+    struct msghdr msg = {0};
+    msg.msg_name = (void *)dest_addr;
+    msg.msg_namelen = dest_addrlen;
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = packet_iovecs(iovs, pkt, len, header);
+    return sendmsg(sockfd, &msg, 0);
+}
+
+/* send the queued upstream queries (through a random socket of each pool) and client replies */
+static void flush_pending_sends(void) {
+    if (g_batch_size == 1) return;
+    for (int i = 0; i < SERVER_MAXCOUNT; ++i) {
+        if (!g_remote_txbatches[i].count) continue;
+        int sockfd = g_remote_sockfds[i][g_sockpool_size > 1 ? arc4random_uniform(g_sockpool_size) : 0];
+        msgbatch_flush(&g_remote_txbatches[i], sockfd, g_remote_ipports[i]);
+    }
+    if (g_local_txbatch.count) msgbatch_flush(&g_local_txbatch, g_bind_sockfd, "client");
+}
+
+/* answer a client on the listen socket with `header` patched in (if not NULL), queued when batching */
+static void send_local_reply(pktbuf_t *pkt, ssize_t reply_len, dns_header_t *header, const skaddr6_t *dest_addr, socklen_t dest_addrlen) {
+    if (reply_len < 0) return; /* malformed, nothing to send */
+    if (g_batch_size > 1) {
+        if (g_local_txbatch.count == g_batch_size) msgbatch_flush(&g_local_txbatch, g_bind_sockfd, "client");
+        msgbatch_push(&g_local_txbatch, pkt, reply_len, header, dest_addr, dest_addrlen);
+        return;
+    }
+    if (send_packet(g_bind_sockfd, pkt, reply_len, header, dest_addr, dest_addrlen) < 0) {
+        portno_t dest_port = 0;
+        parse_socket_addr(dest_addr, g_ipaddrstring_buffer, &dest_port);
+        LOGERR("[send_local_reply] failed to send dns reply packet to %s#%hu: (%d) %s", g_ipaddrstring_buffer, dest_port, errno, strerror(errno));
+    }
+}
+
+/* send a query to the upstreams in [first_idx, last_idx], each through a random socket of its pool (queued when batching) */
+static void send_query(pktbuf_t *pkt, int first_idx, int last_idx) {
+    for (int i = first_idx; i <= last_idx; ++i) {
+        if (g_remote_sockfds[i][0] < 0) continue;
+        socklen_t remote_addrlen = g_remote_skaddrs[i].sin6_family == AF_INET ? sizeof(skaddr4_t) : sizeof(skaddr6_t);
+        if (g_batch_size > 1) {
+            if (g_remote_txbatches[i].count == g_batch_size) flush_pending_sends();
+            msgbatch_push(&g_remote_txbatches[i], pkt, pkt->len, NULL, &g_remote_skaddrs[i], remote_addrlen);
+            continue;
+        }
+        int sockfd = g_remote_sockfds[i][g_sockpool_size > 1 ? arc4random_uniform(g_sockpool_size) : 0];
+        if (sendto(sockfd, pkt->data, pkt->len, 0, (void *)&g_remote_skaddrs[i], remote_addrlen) < 0) {
+            LOGERR("[send_query] failed to send dns query packet to %s: (%d) %s", g_remote_ipports[i], errno, strerror(errno));
+        }
+    }
+}
+
+/* send the query in `g_socket_packet` to the upstreams selected by `dnlmatch_ret`, return a reference to the trust-dns copy (or NULL) */
+static pktbuf_t *forward_query(uint8_t dnlmatch_ret, const skaddr6_t *source_addr) {
+    if (dnlmatch_ret != DNL_MRESULT_GFWLIST) {
+        pktbuf_t *chinadns_query = build_ecs_query(&g_chinadns_ecs, source_addr);
+        send_query(chinadns_query, CHINADNS1_IDX, CHINADNS2_IDX);
+        pktbuf_unref(chinadns_query);
+    }
+    if (dnlmatch_ret == DNL_MRESULT_CHNLIST) return NULL;
+    pktbuf_t *trustdns_query = build_ecs_query(&g_trustdns_ecs, source_addr);
+    send_query(trustdns_query, TRUSTDNS1_IDX, TRUSTDNS2_IDX);
+    return trustdns_query;
+}
+
+/* send the next spaced copy of the trust-dns query */
+static void handle_repeat_event(htimer_t *timer) {
+    racectx_t *race = ((queryctx_t *)timer->data)->race;
+    send_query(race->repeat_pkt, TRUSTDNS1_IDX, TRUSTDNS2_IDX);
+    if (++race->repeat_sent < g_repeat_times) {
+        unsigned shift = race->repeat_sent - 1 < REPEAT_MAX_SHIFT ? race->repeat_sent - 1 : REPEAT_MAX_SHIFT;
+        timer_start(timer, handle_repeat_event, (uint64_t)REPEAT_INTERVAL_MS << shift, 0);
+    } else {
+        pktbuf_unref(race->repeat_pkt);
+        race->repeat_pkt = NULL;
+    }
+}
+
+/* cancel the remaining trust-dns repeats (a trust-dns reply arrived or the query is done) */
+static inline void stop_repeat(queryctx_t *context) {
+    if (!context->race) return;
+    timer_stop(&context->race->repeat_timer);
+    pktbuf_unref(context->race->repeat_pkt);
+    context->race->repeat_pkt = NULL;
+}
+
+/* remove the context from the table and release it (and the held trust-dns reply) */
+static void free_query_context(queryctx_t *context) {
+    MYHASH_DEL(g_query_context_hashtbl, context);
+    timer_stop(&context->query_timer);
+    stop_repeat(context);
+    if (context->race) pktbuf_unref(context->race->trustdns_pkt);
+    free(context);
+}
+
+static void handle_timeout_event(htimer_t *timer);
+
+/* create the context of a forwarded query (`source_addr` is NULL for prefetch), `is_race`: both groups queried or repeats pending */
+static queryctx_t *new_query_context(uint16_t unique_msgid, uint16_t origin_msgid, uint8_t dnlmatch_ret, bool is_race, uint16_t reply_maxlen, uint32_t question_hash, const skaddr6_t *source_addr) {
+    queryctx_t *context = malloc(sizeof(queryctx_t) + (is_race ? sizeof(racectx_t) : 0));
+    context->unique_msgid = unique_msgid;
+    context->origin_msgid = origin_msgid;
+    context->query_timer.data = context;
+    timer_init(&context->query_timer);
+    timer_start(&context->query_timer, handle_timeout_event, g_upstream_timeout_sec * 1000, 0); /* one-shot */
+    // context->query_timerfd = query_timerfd;
+    context->race = is_race ? (racectx_t *)(context + 1) : NULL;
+    if (is_race) {
+        context->race->trustdns_pkt = NULL;
+        context->race->repeat_pkt = NULL;
+        context->race->repeat_sent = 1;
+        context->race->repeat_timer.data = context;
+        timer_init(&context->race->repeat_timer);
+        context->race->chinadns_got = !g_fair_mode;
+    }
+    context->dnlmatch_ret = dnlmatch_ret;
+    context->tap_sampled = source_addr && tap_sample(g_domain_name_buffer);
+    context->query_time = GetTimeUs();
+    context->reply_maxlen = reply_maxlen;
+    context->question_hash = question_hash;
+    context->is_prefetch = !source_addr;
+    context->is_learned = false;
+    if (source_addr) memcpy(&context->source_addr, source_addr, sizeof(*source_addr));
+    MYHASH_ADD(g_query_context_hashtbl, context, &context->unique_msgid, sizeof(context->unique_msgid));
+    return context;
+}
+
+/* re-resolve a popular name whose cached reply is missing or about to expire */
+static void prefetch_query(const char *dname, uint16_t qtype) {
+    if (MYHASH_CNT(g_query_context_hashtbl) >= 65536) return;
+    uint8_t dnlmatch_ret = dnl_ismatch(dname, g_gfwlist_first, NULL);
+    if (dnlmatch_ret == DNL_MRESULT_BLOCK || dnlmatch_ret == DNL_MRESULT_ANSWER) return; /* answered locally, nothing to fetch */
+    pktbuf_t *pkt = pktbuf_new();
+    pkt->len = dns_query_build(pkt->data, dname, qtype);
+    uint8_t edns_key[DNS_EDNS_KEY_MAXLEN];
+    size_t edns_keylen = build_edns_key(pkt->data, pkt->len, edns_key);
+    uint8_t cache_key[CACHE_KEY_MAXLEN];
+    size_t cache_keylen = build_cache_key(pkt->data, pkt->len, edns_key, edns_keylen, NULL, cache_key);
+    if (cache_ttl(cache_key, cache_keylen) > PREFETCH_INTERVAL_SEC * 2) { /* still fresh */
+        pktbuf_unref(pkt);
+        return;
+    }
+
+    uint16_t unique_msgid = msgid_permute(g_current_unique_msgid++);
+    ((dns_header_t *)pkt->data)->id = unique_msgid;
+    IF_VERBOSE LOGINF("[prefetch_query] prefetch [%s] qtype %hu (%hu)", dname, qtype, unique_msgid);
+    g_socket_packet = pkt;
+    pktbuf_unref(forward_query(dnlmatch_ret, NULL)); /* no repeats, nobody is waiting */
+    queryctx_t *context = new_query_context(unique_msgid, 0, dnlmatch_ret, dnlmatch_ret == DNL_MRESULT_NOMATCH, 0, dns_question_hash(pkt->data, pkt->len), NULL);
+    memcpy(context->edns_key, edns_key, edns_keylen);
+    context->edns_keylen = edns_keylen;
+    g_socket_packet = NULL;
+    pktbuf_unref(pkt);
+}
+
+/* handle the periodic prefetch event (loop idle time) */
+static void handle_prefetch_event(htimer_t *timer) {
+    (void)timer;
+    prefetch_run(prefetch_query);
+}
+
+/* handle the periodic verdict decay event */
+static void handle_verdict_event(htimer_t *timer) {
+    (void)timer;
+    verdict_decay();
+}
+
+/* learn the verdict of the domain in `g_domain_name_buffer` from the chnroute check of a china-dns reply */
+static inline void learn_verdict(int ipset_ret) {
+    if (ipset_ret == DNS_IPSET_CHNIP) verdict_learn(g_domain_name_buffer, VERDICT_CHINA);
+    else if (ipset_ret == DNS_IPSET_FOREIGNIP) verdict_learn(g_domain_name_buffer, VERDICT_FOREIGN);
+}
+
+/* handle the periodic cache dump event */
+static void handle_cache_dump_event(htimer_t *timer) {
+    (void)timer;
+    ssize_t count = cache_dump(g_cache_fname);
+    IF_VERBOSE if (count >= 0) LOGINF("[handle_cache_dump_event] dumped %zd cache entries", count);
+}
+
+/* SIGTERM/SIGINT: leave the event loop at the next iteration */
+static void handle_shutdown_signal(int signo) {
+    g_shutdown_signal = signo;
+}
+
+/* SIGUSR1: log the counters at the next iteration */
+static void handle_stats_signal(int signo) {
+    g_stats_signal = signo;
+}
+
+/* log the running counters and the kernel drops of the listen socket */
+static void log_stats(void) {
+    uint64_t kernel_drops = 0;
+    char drops_str[24] = "n/a";
+    if (get_udp_drops(g_bind_sockfd, &kernel_drops)) sprintf(drops_str, "%" PRIu64, kernel_drops - g_kernel_drops_base);
+    LOGINF("[log_stats] queries:%" PRIu64 " ratelimited:%" PRIu64 " rrl:%" PRIu64 " cache-hits:%" PRIu64 " learned:%" PRIu64 " replies:%" PRIu64
+           " truncated:%" PRIu64 " timeouts:%" PRIu64 " dropped:%" PRIu64 " kernel-drops:%s pending:%u",
+           g_stats.queries, g_stats.ratelimited, g_stats.rrl_truncated, g_stats.cache_hits, g_stats.learned, g_stats.replies,
+           g_stats.truncated, g_stats.timeouts, g_stats.dropped, drops_str, (unsigned)MYHASH_CNT(g_query_context_hashtbl));
+}
+
+/* handle the periodic stats event */
+static void handle_stats_event(htimer_t *timer) {
+    (void)timer;
+    log_stats();
+}
+
+/* pin the process to one cpu, false on failure */
+static bool set_cpu_affinity(int cpu) {
+#if defined(__FreeBSD__)
+    cpuset_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1, sizeof(cpuset), &cpuset)) {
+        LOGERR("[set_cpu_affinity] cpuset_setaffinity(%d): (%d) %s", cpu, errno, strerror(errno));
+        return false;
+    }
+    return true;
+#elif defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset)) {
+        LOGERR("[set_cpu_affinity] sched_setaffinity(%d): (%d) %s", cpu, errno, strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    LOGERR("[set_cpu_affinity] cpu affinity is not supported on this system");
+    return false;
+#endif
+}
+
+/* how long the event loop may block: until the next timer, at most EVENT_WAIT_MAXMS */
+static int event_wait_timeout(void) {
+    int64_t timeout = timer_next_timeout();
+    return (timeout < 0 || timeout > EVENT_WAIT_MAXMS) ? EVENT_WAIT_MAXMS : (int)timeout;
+}
+
 /* handle upstream reply timeout event */
 static void handle_timeout_event(htimer_t *timer) {
     queryctx_t *context = NULL;
@@ -334,196 +1177,389 @@ static void handle_timeout_event(htimer_t *timer) {
     //MYHASH_GET(g_query_context_hashtbl, context, &context->unique_msgid, sizeof(context->unique_msgid));
     //if (!context) return; /* due to timing issues, the query context has actually been released */
     LOGERR("[handle_timeout_event] upstream dns server reply timeout, unique msgid: %hu", context->unique_msgid);
-    MYHASH_DEL(g_query_context_hashtbl, context); /* delete query context from the hashtable */
-    timer_stop(&context->query_timer);
+    ++g_stats.timeouts;
+    tap_query_event(context, TAP_VERDICT_TIMEOUT, TAP_UPSTREAM_NONE, NULL);
     // close(context->query_timerfd); /* epoll will automatically remove the associated event */
-    free(context->trustdns_buf); /* release the buffer that stores the trust-dns reply */
-    free(context);
+    free_query_context(context);
 }
 
-/* handle local socket readable event */
-static void handle_local_packet(void) {
+/* handle a query received on the listen socket (in `g_socket_packet`) */
+static void handle_local_packet(const skaddr6_t *source_addr, socklen_t source_addrlen, ssize_t packet_len) {
     if (MYHASH_CNT(g_query_context_hashtbl) >= 65536) { /* range:0~65535, count:65536 */
         LOGERR("[handle_local_packet] unique_msg_id is not enough, refused to serve");
         return;
     }
+    ++g_stats.queries;
 
-    skaddr6_t source_addr = {0};
-    socklen_t source_addrlen = sizeof(skaddr6_t);
-    ssize_t packet_len = recvfrom(g_bind_sockfd, g_socket_buffer, SOCKBUFF_MAXSIZE, 0, (void *)&source_addr, &source_addrlen);
-
-    if (packet_len < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            LOGERR("[handle_local_packet] failed to recv data from bind socket: (%d) %s", errno, strerror(errno));
+    uint64_t limit_key = (g_ratelimit || g_rrl) ? client_limit_key(source_addr) : 0;
+    if (g_ratelimit && !ratelimit_allow(g_ratelimit, limit_key)) {
+        IF_VERBOSE {
+            portno_t source_port = 0;
+            parse_socket_addr(source_addr, g_ipaddrstring_buffer, &source_port);
+            LOGINF("[handle_local_packet] drop query from %s#%hu (rate limit)", g_ipaddrstring_buffer, source_port);
         }
+        ++g_stats.ratelimited;
         return;
     }
 
     uint16_t qtype;
-    if (!dns_query_check(g_socket_buffer, packet_len, (g_verbose || g_gfwlist_fname || g_chnlist_fname) ? g_domain_name_buffer : NULL, &qtype)) return;
+    if (!dns_query_check(g_socket_packet->data, packet_len, (g_verbose || g_gfwlist_fname || g_chnlist_fname || g_rule_fname || verdict_enabled() || tap_enabled()) ? g_domain_name_buffer : NULL, &qtype)) return;
 
     IF_VERBOSE {
         portno_t source_port = 0;
-        parse_socket_addr(&source_addr, g_ipaddrstring_buffer, &source_port);
-        LOGINF("[handle_local_packet] query [%s] from %s#%hu (%hu)", g_domain_name_buffer, g_ipaddrstring_buffer, source_port, g_current_unique_msgid);
+        parse_socket_addr(source_addr, g_ipaddrstring_buffer, &source_port);
+        LOGINF("[handle_local_packet] query [%s] from %s#%hu (%hu)", g_domain_name_buffer, g_ipaddrstring_buffer, source_port, msgid_permute(g_current_unique_msgid));
     }
 
     if (g_no_ipv6_query && qtype == DNS_RECORD_TYPE_AAAA) {
         IF_VERBOSE LOGINF("[handle_local_packet] reply [%s] without answer (by ipv6 filter)", g_domain_name_buffer);
-        dns_header_t *header = (dns_header_t *)g_socket_buffer;
+        dns_header_t *header = (dns_header_t *)g_socket_packet->data;
         header->qr = DNS_QR_REPLY;
         header->rcode = DNS_RCODE_REFUSED;
-        sendto(g_bind_sockfd, g_socket_buffer, packet_len, 0, (void *)&source_addr, source_addrlen);
+        send_local_reply(g_socket_packet, packet_len, NULL, source_addr, source_addrlen);
         return;
     }
 
-    uint16_t unique_msgid = g_current_unique_msgid++;
-    dns_header_t *dns_header = (dns_header_t *)g_socket_buffer;
-    uint16_t origin_msgid = dns_header->id;
-    dns_header->id = unique_msgid; /* replace with new msgid */
-    uint8_t dnlmatch_ret = (g_gfwlist_fname || g_chnlist_fname) ? dnl_ismatch(g_domain_name_buffer, g_gfwlist_first) : DNL_MRESULT_NOMATCH;
+    /* over the response rate: an empty truncated reply, nothing to amplify and a real client retries over tcp */
+    if (g_rrl) {
+        uint8_t question_key[CACHE_KEY_MAXLEN];
+        size_t question_keylen = build_cache_key(g_socket_packet->data, packet_len, NULL, 0, NULL, question_key);
+        if (!ratelimit_allow(g_rrl, ratelimit_hash(limit_key, question_key, question_keylen) | 1)) {
+            IF_VERBOSE LOGINF("[handle_local_packet] reply [%s] truncated (response rate limit)", g_domain_name_buffer);
+            ++g_stats.rrl_truncated;
+            ssize_t reply_len = dns_reply_truncate(g_socket_packet->data, packet_len);
+            ((dns_header_t *)g_socket_packet->data)->qr = DNS_QR_REPLY;
+            send_local_reply(g_socket_packet, reply_len, NULL, source_addr, source_addrlen);
+            return;
+        }
+    }
 
-    for (int i = 0; i < SERVER_MAXCOUNT; ++i) {
-        if (g_remote_sockfds[i] < 0) continue;
-        uint8_t repeat_times = 0;
-        if (i == CHINADNS1_IDX || i == CHINADNS2_IDX) {
-            repeat_times = (dnlmatch_ret == DNL_MRESULT_GFWLIST) ? 0 : 1;
-        } else {
-            repeat_times = (dnlmatch_ret == DNL_MRESULT_CHNLIST) ? 0 : g_repeat_times;
+    /* advertise our own size upstream, answer the client within its size */
+    uint16_t client_udpsize = dns_edns_udpsize(g_socket_packet->data, packet_len, g_edns_udpsize);
+    if (client_udpsize > DNS_EDNS_UDPSIZE_MAX) client_udpsize = DNS_EDNS_UDPSIZE_MAX;
+
+    const dnlanswer_t *rule_answer = NULL;
+    uint8_t dnlmatch_ret = (g_gfwlist_fname || g_chnlist_fname || g_rule_fname) ? dnl_ismatch(g_domain_name_buffer, g_gfwlist_first, &rule_answer) : DNL_MRESULT_NOMATCH;
+
+    /* blocked or fixed by a rule: answered here, no upstream and no race */
+    if (dnlmatch_ret == DNL_MRESULT_BLOCK || dnlmatch_ret == DNL_MRESULT_ANSWER) {
+        const void *rdata = NULL;
+        uint16_t rdatalen = 0;
+        if (dnlmatch_ret == DNL_MRESULT_ANSWER && qtype == DNS_RECORD_TYPE_A && rule_answer->has_ip4) {
+            rdata = rule_answer->ip4;
+            rdatalen = sizeof(rule_answer->ip4);
+        } else if (dnlmatch_ret == DNL_MRESULT_ANSWER && qtype == DNS_RECORD_TYPE_AAAA && rule_answer->has_ip6) {
+            rdata = rule_answer->ip6;
+            rdatalen = sizeof(rule_answer->ip6);
         }
-        socklen_t remote_addrlen = g_remote_skaddrs[i].sin6_family == AF_INET ? sizeof(skaddr4_t) : sizeof(skaddr6_t);
-        for (int j = 0; j < repeat_times; ++j) {
-            if (sendto(g_remote_sockfds[i], g_socket_buffer, packet_len, 0, (void *)&g_remote_skaddrs[i], remote_addrlen) < 0) {
-                LOGERR("[handle_local_packet] failed to send dns query packet to %s: (%d) %s", g_remote_ipports[i], errno, strerror(errno));
+        uint8_t rcode = dnlmatch_ret == DNL_MRESULT_BLOCK ? DNS_RCODE_NXDOMAIN : DNS_RCODE_NOERROR;
+        ssize_t reply_len = dns_reply_build(g_socket_packet->data, packet_len, DNS_PACKET_MAXSIZE, rcode, qtype, rdata, rdatalen, RULE_ANSWER_TTL);
+        if (reply_len < 0) return;
+        IF_VERBOSE LOGINF("[handle_local_packet] reply [%s] from <rule>, result: %s", g_domain_name_buffer, dnlmatch_ret == DNL_MRESULT_BLOCK ? "block" : "answer");
+        if (tap_sample(g_domain_name_buffer)) tap_write(TAP_VERDICT_ACCEPT, TAP_UPSTREAM_RULE, dnlmatch_ret, 0, 0, g_domain_name_buffer);
+        send_local_reply(g_socket_packet, reply_len, NULL, source_addr, source_addrlen);
+        return;
+    }
+    if (dnlmatch_ret != DNL_MRESULT_NOMATCH && prefetch_enabled()) prefetch_hit(g_domain_name_buffer, qtype);
+
+    dns_header_t *dns_header = (dns_header_t *)g_socket_packet->data;
+    uint16_t origin_msgid = dns_header->id;
+
+    uint8_t edns_key[DNS_EDNS_KEY_MAXLEN];
+    size_t edns_keylen = cache_enabled() ? build_edns_key(g_socket_packet->data, packet_len, edns_key) : 0; /* before forward_query rewrites the ecs */
+    if (cache_enabled()) {
+        uint8_t cache_key[CACHE_KEY_MAXLEN];
+        size_t cache_keylen = build_cache_key(g_socket_packet->data, packet_len, edns_key, edns_keylen, source_addr, cache_key);
+        ssize_t reply_len = cache_get(cache_key, cache_keylen, g_socket_packet->data);
+        if (reply_len >= 0) {
+            IF_VERBOSE LOGINF("[handle_local_packet] reply [%s] from <cache>, result: accept", g_domain_name_buffer);
+            if (tap_sample(g_domain_name_buffer)) tap_write(TAP_VERDICT_ACCEPT, TAP_UPSTREAM_CACHE, dnlmatch_ret, 0, 0, g_domain_name_buffer);
+            ++g_stats.cache_hits;
+            if (reply_len > client_udpsize) {
+                reply_len = dns_reply_truncate(g_socket_packet->data, reply_len);
+                if (reply_len < 0) return; /* malformed: drop it */
+                ++g_stats.truncated;
             }
+            dns_header->id = origin_msgid;
+            send_local_reply(g_socket_packet, reply_len, NULL, source_addr, source_addrlen);
+            return;
         }
     }
 
-    queryctx_t *context = malloc(sizeof(queryctx_t));
-    context->unique_msgid = unique_msgid;
-    context->origin_msgid = origin_msgid;
-    context->query_timer.data = context;
-    timer_init(&context->query_timer);
-    timer_start(&context->query_timer, handle_timeout_event, g_upstream_timeout_sec*1000,g_upstream_timeout_sec*1000);
-    // context->query_timerfd = query_timerfd;
-    context->trustdns_buf = NULL;
-    context->chinadns_got = !g_fair_mode;
-    context->dnlmatch_ret = dnlmatch_ret;
-    memcpy(&context->source_addr, &source_addr, sizeof(source_addr));
-    MYHASH_ADD(g_query_context_hashtbl, context, &context->unique_msgid, sizeof(context->unique_msgid));
+    /* unlisted: the verdict learned from earlier replies of the same domain picks one upstream group */
+    bool is_learned = false;
+    if (dnlmatch_ret == DNL_MRESULT_NOMATCH && verdict_enabled()) {
+        uint8_t verdict = verdict_get(g_domain_name_buffer);
+        if (verdict != VERDICT_NONE) {
+            dnlmatch_ret = verdict == VERDICT_CHINA ? DNL_MRESULT_CHNLIST : DNL_MRESULT_GFWLIST;
+            is_learned = true;
+            ++g_stats.learned;
+            IF_VERBOSE LOGINF("[handle_local_packet] query [%s] routed to %s (learned)", g_domain_name_buffer, verdict == VERDICT_CHINA ? "chinadns" : "trustdns");
+        }
+    }
+
+    uint16_t unique_msgid = msgid_permute(g_current_unique_msgid++);
+    dns_header->id = unique_msgid; /* replace with new msgid */
+
+    pktbuf_t *trustdns_query = forward_query(dnlmatch_ret, source_addr);
+    bool is_race = dnlmatch_ret == DNL_MRESULT_NOMATCH || (trustdns_query && g_repeat_times > 1);
+    queryctx_t *context = new_query_context(unique_msgid, origin_msgid, dnlmatch_ret, is_race, client_udpsize, dns_question_hash(g_socket_packet->data, packet_len), source_addr);
+    context->is_learned = is_learned;
+    memcpy(context->edns_key, edns_key, edns_keylen);
+    context->edns_keylen = edns_keylen;
+    if (trustdns_query && g_repeat_times > 1) {
+        context->race->repeat_pkt = trustdns_query; /* keeps the reference, no copy */
+        timer_start(&context->race->repeat_timer, handle_repeat_event, REPEAT_INTERVAL_MS, 0);
+    } else {
+        pktbuf_unref(trustdns_query);
+    }
+    tap_query_event(context, TAP_VERDICT_QUERY, TAP_UPSTREAM_NONE, g_domain_name_buffer);
 }
 
-/* handle remote socket readable event */
-static void handle_remote_packet(int index) {
-    int remote_sockfd = g_remote_sockfds[index];
-    const char *remote_ipport = g_remote_ipports[index];
-    ssize_t packet_len = recvfrom(remote_sockfd, g_socket_buffer, SOCKBUFF_MAXSIZE, 0, NULL, NULL);
+/* handle local socket readable event: receive up to `g_batch_size` queries with one recvmmsg() */
+static void handle_local_packets(void) {
+    msgbatch_t *batch = &g_rxbatch;
+    msgbatch_prepare_recv(batch);
+    int count = recvmmsg(g_bind_sockfd, batch->msgs, g_batch_size, 0, NULL);
 
-    if (packet_len < 0) {
+    if (count < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            LOGERR("[handle_remote_packet] failed to recv data from %s: (%d) %s", remote_ipport, errno, strerror(errno));
+            LOGERR("[handle_local_packets] failed to recv data from bind socket: (%d) %s", errno, strerror(errno));
         }
         return;
     }
+    for (int i = 0; i < count; ++i) {
+        if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) { /* larger than DNS_PACKET_MAXSIZE, not a query we can parse */
+            IF_VERBOSE LOGINF("[handle_local_packets] drop query larger than %d bytes", DNS_PACKET_MAXSIZE);
+            continue;
+        }
+        g_socket_packet = batch->pkts[i];
+        g_socket_packet->len = batch->msgs[i].msg_len;
+        handle_local_packet(&batch->addrs[i], batch->msgs[i].msg_hdr.msg_namelen, batch->msgs[i].msg_len);
+    }
+    g_socket_packet = NULL;
+    flush_pending_sends();
+}
+
+/* turn the china-dns reply in `g_socket_packet` back into its query and ask trust-dns, the context now waits for trust-dns */
+static void requery_trustdns(queryctx_t *context, ssize_t packet_len) {
+    ssize_t query_len = dns_reply_truncate(g_socket_packet->data, packet_len); /* header, question and OPT */
+    if (query_len < 0) return; /* left to the query timer */
+    dns_header_t *header = (dns_header_t *)g_socket_packet->data;
+    header->qr = DNS_QR_QUERY;
+    header->aa = 0;
+    header->tc = 0;
+    header->ra = 0;
+    header->z = 0; /* ad and cd */
+    header->rcode = DNS_RCODE_NOERROR;
+    query_len = dns_ecs_rewrite(g_socket_packet->data, query_len, SOCKBUFF_MAXSIZE, 0, NULL, 0); /* the china ecs (with its scope); forward_query sets the trust one */
+    if (query_len < 0) return;
+    g_socket_packet->len = query_len;
+    dns_edns_udpsize(g_socket_packet->data, query_len, g_edns_udpsize ? g_edns_udpsize : context->reply_maxlen); /* prefetch (0): keep */
+    context->dnlmatch_ret = DNL_MRESULT_GFWLIST;
+    context->is_learned = false;
+    pktbuf_unref(forward_query(DNL_MRESULT_GFWLIST, context->is_prefetch ? NULL : &context->source_addr)); /* no repeats */
+}
+
+/* handle a reply received on an upstream socket (in `g_socket_packet`) */
+static void handle_remote_packet(int index, ssize_t packet_len) {
+    const char *remote_ipport = g_remote_ipports[index];
     if (packet_len < (ssize_t)sizeof(dns_header_t)) {
-        LOGERR("[handle_remote_packet] received bad reply from %s, packet too small: %zd", remote_ipport, packet_len);
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply from %s, result: drop (packet too small: %zd)", remote_ipport, packet_len);
+        ++g_stats.dropped;
         return;
     }
 
+    /* late, duplicate and spoofed replies are dropped on the header and the question, before parsing */
     bool is_chinadns = index == CHINADNS1_IDX || index == CHINADNS2_IDX;
-    bool is_accept = dns_reply_check(g_socket_buffer, packet_len, g_verbose ? g_domain_name_buffer : NULL, is_chinadns);
-
     queryctx_t *context = NULL;
-    dns_header_t *dns_header = (dns_header_t *)g_socket_buffer;
+    dns_header_t *dns_header = (dns_header_t *)g_socket_packet->data;
+    if (dns_header->qr != DNS_QR_REPLY || dns_header->question_count != htons(1)) {
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply from %s (%hu), result: drop (not a reply to one question)", remote_ipport, dns_header->id);
+        ++g_stats.dropped;
+        return;
+    }
     MYHASH_GET(g_query_context_hashtbl, context, &dns_header->id, sizeof(dns_header->id));
     if (!context) {
-        IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: ignore", g_domain_name_buffer, remote_ipport, dns_header->id);
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply from %s (%hu), result: ignore", remote_ipport, dns_header->id);
+        ++g_stats.dropped;
+        return;
+    }
+    if (context->dnlmatch_ret == (is_chinadns ? DNL_MRESULT_GFWLIST : DNL_MRESULT_CHNLIST)) {
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply from %s (%hu), result: drop (upstream not queried)", remote_ipport, dns_header->id);
+        ++g_stats.dropped;
+        return;
+    }
+    if (dns_question_hash(g_socket_packet->data, packet_len) != context->question_hash) {
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply from %s (%hu), result: drop (question mismatch)", remote_ipport, dns_header->id);
+        ++g_stats.dropped;
+        return;
+    }
+
+    pktbuf_t *reply_packet = g_socket_packet;
+    size_t reply_length = packet_len;
+    racectx_t *race = context->race;
+
+    /* single upstream group: the first reply is the answer, no race state and no china-ip check */
+    if (!race) {
+        if (context->is_learned && is_chinadns) {
+            int ipset_ret = dns_reply_ipset(g_socket_packet->data, packet_len, g_domain_name_buffer);
+            if (ipset_ret == DNS_IPSET_FOREIGNIP) { /* the learned verdict is wrong (or the reply poisoned): never forward it */
+                IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: filter (learned verdict dropped)", g_domain_name_buffer, remote_ipport, dns_header->id);
+                tap_query_event(context, TAP_VERDICT_FILTER, index, g_domain_name_buffer);
+                verdict_forget(g_domain_name_buffer);
+                requery_trustdns(context, packet_len);
+                return;
+            }
+            learn_verdict(ipset_ret); /* keep confirming it */
+        } else if (g_verbose || tap_enabled()) {
+            dns_reply_check(g_socket_packet->data, packet_len, g_domain_name_buffer, false);
+        }
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: accept", g_domain_name_buffer, remote_ipport, dns_header->id);
+        tap_query_event(context, TAP_VERDICT_ACCEPT, index, g_domain_name_buffer);
+        goto SEND_REPLY;
+    }
+
+    if (!is_chinadns && race->trustdns_pkt) {
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply from %s (%hu), result: ignore", remote_ipport, dns_header->id);
+        tap_query_event(context, TAP_VERDICT_IGNORE, index, NULL);
+        ++g_stats.dropped;
         return;
     }
+    if (!is_chinadns) stop_repeat(context); /* trust-dns answered, no more copies needed */
 
-    void *reply_buffer = NULL;
-    size_t reply_length = 0;
+    bool is_accept = false;
+    if (is_chinadns && verdict_enabled()) {
+        int ipset_ret = dns_reply_ipset(g_socket_packet->data, packet_len, g_domain_name_buffer);
+        is_accept = ipset_ret == DNS_IPSET_CHNIP || ipset_ret == DNS_IPSET_NOTADDR || (ipset_ret == DNS_IPSET_NOIP && g_noip_as_chnip);
+        learn_verdict(ipset_ret);
+    } else {
+        is_accept = dns_reply_check(g_socket_packet->data, packet_len, (g_verbose || tap_enabled()) ? g_domain_name_buffer : NULL, is_chinadns);
+    }
 
     if (is_chinadns) {
         if (context->dnlmatch_ret == DNL_MRESULT_CHNLIST || is_accept) {
             IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: accept", g_domain_name_buffer, remote_ipport, dns_header->id);
-            if (context->trustdns_buf) {
+            tap_query_event(context, TAP_VERDICT_ACCEPT, index, g_domain_name_buffer);
+            if (race->trustdns_pkt) {
                 IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from <previous-trustdns> (%hu), result: filter", g_domain_name_buffer, dns_header->id);
+                tap_query_event(context, TAP_VERDICT_FILTER, TAP_UPSTREAM_NONE, g_domain_name_buffer);
             }
-            reply_buffer = g_socket_buffer;
-            reply_length = packet_len;
             goto SEND_REPLY;
         } else {
             IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: filter", g_domain_name_buffer, remote_ipport, dns_header->id);
-            if (context->trustdns_buf) {
+            tap_query_event(context, TAP_VERDICT_FILTER, index, g_domain_name_buffer);
+            if (race->trustdns_pkt) {
                 IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from <previous-trustdns> (%hu), result: accept", g_domain_name_buffer, dns_header->id);
-                reply_buffer = context->trustdns_buf + sizeof(uint16_t);
-                reply_length = *(uint16_t *)context->trustdns_buf;
+                tap_query_event(context, TAP_VERDICT_ACCEPT, TAP_UPSTREAM_NONE, g_domain_name_buffer);
+                reply_packet = race->trustdns_pkt;
+                reply_length = race->trustdns_pkt->len;
                 goto SEND_REPLY;
             } else {
-                context->chinadns_got = true;
+                race->chinadns_got = true;
                 return;
             }
         }
     } else {
-        if (context->dnlmatch_ret == DNL_MRESULT_GFWLIST || context->chinadns_got) {
+        if (context->dnlmatch_ret == DNL_MRESULT_GFWLIST || race->chinadns_got) {
             IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: accept", g_domain_name_buffer, remote_ipport, dns_header->id);
-            reply_buffer = g_socket_buffer;
-            reply_length = packet_len;
+            tap_query_event(context, TAP_VERDICT_ACCEPT, index, g_domain_name_buffer);
             goto SEND_REPLY;
         } else {
-            if (context->trustdns_buf) {
-                IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: ignore", g_domain_name_buffer, remote_ipport, dns_header->id);
-            } else {
-                IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: delay", g_domain_name_buffer, remote_ipport, dns_header->id);
-                context->trustdns_buf = malloc(sizeof(uint16_t) + packet_len);
-                *(uint16_t *)context->trustdns_buf = packet_len; /* dns reply length */
-                memcpy(context->trustdns_buf + sizeof(uint16_t), g_socket_buffer, packet_len);
-            }
+            IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] from %s (%hu), result: delay", g_domain_name_buffer, remote_ipport, dns_header->id);
+            tap_query_event(context, TAP_VERDICT_DELAY, index, g_domain_name_buffer);
+            race->trustdns_pkt = pktbuf_ref(g_socket_packet); /* held as received, no copy */
             return;
         }
     }
 
 SEND_REPLY:
-    dns_header = reply_buffer;
-    dns_header->id = context->origin_msgid; /* replace with old msgid */
-    socklen_t source_addrlen = (context->source_addr.sin6_family == AF_INET) ? sizeof(skaddr4_t) : sizeof(skaddr6_t);
-    if (sendto(g_bind_sockfd, reply_buffer, reply_length, 0, (void *)&context->source_addr, source_addrlen) < 0) {
-        portno_t source_port = 0;
-        parse_socket_addr(&context->source_addr, g_ipaddrstring_buffer, &source_port);
-        LOGERR("[handle_remote_packet] failed to send dns reply packet to %s#%hu: (%d) %s", g_ipaddrstring_buffer, source_port, errno, strerror(errno));
+    if (cache_enabled() || g_min_ttl || g_max_ttl) {
+        /* one pass for the ttl offsets: clamped in place, then the cache lifetime follows the clamped ttls */
+        uint16_t ttl_offsets[DNS_RECORD_MAXCOUNT];
+        int ttlcount = dns_ttl_offsets(reply_packet->data, reply_length, ttl_offsets, DNS_RECORD_MAXCOUNT);
+        if (ttlcount > 0 && (g_min_ttl || g_max_ttl)) dns_ttl_clamp(reply_packet->data, ttl_offsets, ttlcount, g_min_ttl, g_max_ttl);
+        if (ttlcount > 0 && cache_enabled()) { /* the walk checked the question and every record */
+            uint8_t cache_key[CACHE_KEY_MAXLEN];
+            size_t cache_keylen = build_cache_key(reply_packet->data, reply_length, context->edns_key, context->edns_keylen, context->is_prefetch ? NULL : &context->source_addr, cache_key);
+            cache_put(cache_key, cache_keylen, reply_packet->data, reply_length, ttl_offsets, ttlcount);
+        }
     }
-    MYHASH_DEL(g_query_context_hashtbl, context);
-    timer_stop(&context->query_timer);
-    free(context->trustdns_buf);
-    free(context);
+    if (context->is_prefetch) goto RELEASE_CONTEXT;
+    ++g_stats.replies;
+    if (reply_length > context->reply_maxlen) {
+        ++g_stats.truncated;
+        IF_VERBOSE LOGINF("[handle_remote_packet] reply [%s] (%hu) is truncated: %zu > %hu", g_domain_name_buffer, context->unique_msgid, reply_length, context->reply_maxlen);
+        ssize_t truncated_len = dns_reply_truncate(reply_packet->data, reply_length);
+        reply_length = truncated_len < 0 ? 0 : (size_t)truncated_len; /* malformed: drop it */
+    }
+    dns_header_t reply_header = *(dns_header_t *)reply_packet->data; /* patched copy, sent in front of the rest of the packet */
+    reply_header.id = context->origin_msgid; /* replace with old msgid */
+    socklen_t source_addrlen = (context->source_addr.sin6_family == AF_INET) ? sizeof(skaddr4_t) : sizeof(skaddr6_t);
+    if (reply_length) send_local_reply(reply_packet, reply_length, &reply_header, &context->source_addr, source_addrlen);
+RELEASE_CONTEXT:
+    free_query_context(context);
 }
 
 
 
+/* handle remote socket readable event: receive up to `g_batch_size` replies with one recvmmsg() */
+static void handle_remote_packets(int index, int remote_sockfd) {
+    msgbatch_t *batch = &g_rxbatch;
+    msgbatch_prepare_recv(batch);
+    int count = recvmmsg(remote_sockfd, batch->msgs, g_batch_size, 0, NULL);
+
+    if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOGERR("[handle_remote_packets] failed to recv data from %s: (%d) %s", g_remote_ipports[index], errno, strerror(errno));
+        }
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        g_socket_packet = batch->pkts[i];
+        ssize_t packet_len = batch->msgs[i].msg_len;
+        if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) { /* cut to the buffer: keep only what is complete and set TC, the client retries over tcp */
+            IF_VERBOSE LOGINF("[handle_remote_packets] reply from %s larger than %d bytes, truncated", g_remote_ipports[index], DNS_PACKET_MAXSIZE);
+            packet_len = dns_reply_truncate(g_socket_packet->data, packet_len);
+            if (packet_len < 0) {
+                ++g_stats.dropped;
+                continue;
+            }
+        }
+        g_socket_packet->len = packet_len;
+        handle_remote_packet(index, packet_len);
+    }
+    g_socket_packet = NULL;
+    flush_pending_sends();
+}
+
 //
-// Purpose: 
+// Purpose: wait up to timeout_ms (-1: forever) for the first batch, drain the rest without waiting
 //
-void doevent(void)
+int doevent(int timeout_ms)
 {
 	struct kevent events[MAX_EVENTS];
 	int rc;
 	int i;
 	int fd;
 	int j;
+	int handled = 0;
 	struct timespec ts;
     uint32_t curr_data;
 
-	memset(&ts, 0, sizeof(ts));
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
 
 	for(j = 0; j < 30; j++)
 	{
-		rc = kevent(event_ident, NULL, 0, events, MAX_EVENTS, &ts);
+		rc = kevent(event_ident, NULL, 0, events, MAX_EVENTS, (j == 0 && timeout_ms < 0) ? NULL : &ts);
+		memset(&ts, 0, sizeof(ts));
 		
 		if (rc == 0 || rc < 0)
-			return;
+			return handled;
 
-		realtime = GetTime();
+		UpdateRealTime();
+		handled += rc;
 
 		for (i = 0;i < rc; i++)
 		{
@@ -563,31 +1599,37 @@ void doevent(void)
                  /* handle readable event */
                 switch (curr_data & IDX_MARK_MASK) {
                     case CHINADNS1_IDX:
-                        handle_remote_packet(CHINADNS1_IDX);
+                        handle_remote_packets(CHINADNS1_IDX, fd);
                         break;
                     case CHINADNS2_IDX:
-                        handle_remote_packet(CHINADNS2_IDX);
+                        handle_remote_packets(CHINADNS2_IDX, fd);
                         break;
                     case TRUSTDNS1_IDX:
-                        handle_remote_packet(TRUSTDNS1_IDX);
+                        handle_remote_packets(TRUSTDNS1_IDX, fd);
                         break;
                     case TRUSTDNS2_IDX:
-                        handle_remote_packet(TRUSTDNS2_IDX);
+                        handle_remote_packets(TRUSTDNS2_IDX, fd);
                         break;
                     case BINDSOCK_MARK:
-                        handle_local_packet();
+                        handle_local_packets();
                         break;
                 }
 			}
 		}
 	}
+	return handled;
 }
 
 
 int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, handle_shutdown_signal);
+    signal(SIGINT, handle_shutdown_signal);
+    signal(SIGUSR1, handle_stats_signal);
     setvbuf(stdout, NULL, _IOLBF, 256);
     parse_command_args(argc, argv);
+    UpdateRealTime();
+    log_init(g_log_format);
 
     /* show startup information */
     LOGINF("[main] local listen addr: %s#%hu", g_bind_ipstr, g_bind_portno);
@@ -606,6 +1648,7 @@ int main(int argc, char *argv[]) {
     LOGINF("[main] dns query timeout: %ld seconds", g_upstream_timeout_sec);
     if (g_gfwlist_fname) LOGINF("[main] gfwlist entries count: %zu", dnl_init(g_gfwlist_fname, true));
     if (g_chnlist_fname) LOGINF("[main] chnlist entries count: %zu", dnl_init(g_chnlist_fname, false));
+    if (g_rule_fname) LOGINF("[main] routing rules count: %zu", dnl_rule_init(g_rule_fname));
     if (g_gfwlist_fname && g_chnlist_fname) LOGINF("[main] %s have higher priority", g_gfwlist_first ? "gfwlist" : "chnlist");
     if (g_repeat_times > 1) LOGINF("[main] enable repeat mode, times: %hhu", g_repeat_times);
     LOGINF("[main] %s reply without ip addr", g_noip_as_chnip ? "accept" : "filter");
@@ -613,20 +1656,78 @@ int main(int argc, char *argv[]) {
     if (g_no_ipv6_query) LOGINF("[main] filter ipv6-address dns-query");
     if (g_reuse_port) LOGINF("[main] enable `SO_REUSEPORT` feature");
     if (g_verbose) LOGINF("[main] print the verbose running log");
+    if (g_chinadns_ecs.mode != ECS_MODE_KEEP) LOGINF("[main] china-dns client subnet: %s", ecs_mode_string(&g_chinadns_ecs));
+    if (g_trustdns_ecs.mode != ECS_MODE_KEEP) LOGINF("[main] trust-dns client subnet: %s", ecs_mode_string(&g_trustdns_ecs));
+    if (g_edns_udpsize) LOGINF("[main] edns udp payload size: %hu", g_edns_udpsize);
+    if (g_min_ttl || g_max_ttl) LOGINF("[main] clamp reply ttls to [%u, %u]", g_min_ttl, g_max_ttl ? g_max_ttl : UINT32_MAX);
+    if (g_cache_size) {
+        cache_init(g_cache_size);
+        LOGINF("[main] answer cache capacity: %zu", g_cache_size);
+    }
+    if (g_ratelimit_qps) {
+        g_ratelimit = ratelimit_new(g_ratelimit_qps, g_ratelimit_burst);
+        LOGINF("[main] rate limit: %u qps, burst %u (per client /24 or /56)", g_ratelimit_qps, g_ratelimit_burst);
+    }
+    if (g_rrl_rps) {
+        g_rrl = ratelimit_new(g_rrl_rps, g_rrl_rps);
+        LOGINF("[main] response rate limit: %u identical answers per second", g_rrl_rps);
+    }
+    if (g_cache_fname) {
+        LOGINF("[main] answer cache file: %s, %zu entries restored", g_cache_fname, cache_load(g_cache_fname));
+        timer_init(&g_cache_dump_timer);
+        timer_start(&g_cache_dump_timer, handle_cache_dump_event, CACHE_DUMP_INTERVAL_SEC * 1000, CACHE_DUMP_INTERVAL_SEC * 1000);
+    }
+    if (g_prefetch_count && (g_chinadns_ecs.mode == ECS_MODE_CLIENT || g_trustdns_ecs.mode == ECS_MODE_CLIENT)) {
+        /* cache keys carry the client subnet, a prefetched (subnet-less) entry would never be hit */
+        LOGERR("[main] prefetch is disabled: it does not work with the client subnet ecs");
+        g_prefetch_count = 0;
+    }
+    if (g_prefetch_count) {
+        prefetch_init(g_prefetch_count, g_prefetch_fname);
+        timer_init(&g_prefetch_timer);
+        timer_start(&g_prefetch_timer, handle_prefetch_event, PREFETCH_INTERVAL_SEC * 1000, PREFETCH_INTERVAL_SEC * 1000);
+        LOGINF("[main] prefetch top %zu names%s%s", g_prefetch_count, g_prefetch_fname ? ", table: " : "", g_prefetch_fname ? g_prefetch_fname : "");
+    }
+    if (g_verdict_size) {
+        verdict_init(g_verdict_size);
+        timer_init(&g_verdict_timer);
+        timer_start(&g_verdict_timer, handle_verdict_event, VERDICT_DECAY_SEC * 1000, VERDICT_DECAY_SEC * 1000);
+        LOGINF("[main] learn the verdicts of up to %zu unlisted domains", g_verdict_size);
+    }
+    if (g_tap_fname) {
+        tap_init(g_tap_fname, g_tap_sample_rate, g_tap_domain);
+        LOGINF("[main] query tap: %s, 1/%u sampled%s%s", g_tap_fname, g_tap_sample_rate, g_tap_domain ? ", domain: " : "", g_tap_domain ? g_tap_domain : "");
+    }
 
     event_init();
 
+    /* msgid permutation key and starting point */
+    for (int i = 0; i < 4; ++i) g_msgid_keys[i] = arc4random();
+    g_current_unique_msgid = arc4random();
+    if (g_sockpool_size > 1) LOGINF("[main] %hhu random-port sockets per upstream", g_sockpool_size);
+
     /* init ipset netlink socket */
     chnroute_init();
 
     /* create listen socket */
     g_bind_sockfd = new_udp_socket(g_bind_skaddr.sin6_family);
     if (g_reuse_port) set_reuse_port(g_bind_sockfd);
+    if (g_busy_poll_usec && set_busy_poll(g_bind_sockfd, g_busy_poll_usec)) LOGINF("[main] enable `SO_BUSY_POLL` on the listen socket");
+    int rcvbuf = set_socket_bufsize(g_bind_sockfd, SO_RCVBUF, g_socket_rcvbuf);
+    int sndbuf = set_socket_bufsize(g_bind_sockfd, SO_SNDBUF, g_socket_sndbuf);
+    LOGINF("[main] socket buffer size: rcvbuf %d, sndbuf %d%s", rcvbuf, sndbuf, (g_socket_rcvbuf || g_socket_sndbuf) ? "" : " (system default)");
 
-    /* create remote socket */
+    /* create remote socket pools */
+    memset(g_remote_sockfds, -1, sizeof(g_remote_sockfds));
     for (int i = 0; i < SERVER_MAXCOUNT; ++i) {
         if (!strlen(g_remote_ipports[i])) continue;
-        g_remote_sockfds[i] = new_udp_socket(g_remote_skaddrs[i].sin6_family);
+        for (int j = 0; j < g_sockpool_size; ++j) {
+            g_remote_sockfds[i][j] = new_udp_socket(g_remote_skaddrs[i].sin6_family);
+            bind_random_port(g_remote_sockfds[i][j], g_remote_skaddrs[i].sin6_family);
+            set_socket_bufsize(g_remote_sockfds[i][j], SO_RCVBUF, g_socket_rcvbuf);
+            set_socket_bufsize(g_remote_sockfds[i][j], SO_SNDBUF, g_socket_sndbuf);
+            if (g_busy_poll_usec) set_busy_poll(g_remote_sockfds[i][j], g_busy_poll_usec);
+        }
     }
 
     /* bind address to listen socket */
@@ -645,25 +1746,57 @@ int main(int argc, char *argv[]) {
 
     /* remote socket readable event */
     for (int i = 0; i < SERVER_MAXCOUNT; ++i) {
-        if (g_remote_sockfds[i] < 0)
+        if (g_remote_sockfds[i][0] < 0)
             continue;
 
-        g_remote_sockfds_events[i].u32 = i;
+        for (int j = 0; j < g_sockpool_size; ++j) {
+            g_remote_sockfds_events[i][j].u32 = ((uint32_t)j << BIT_SHIFT_LEN) | i; /* pool slot | upstream index */
 
-        if(event_add(g_remote_sockfds[i], &g_remote_sockfds_events[i])) {
-            LOGERR("[main] failed to register to event: (%d) %s", errno, strerror(errno));
-             return errno;
+            if(event_add(g_remote_sockfds[i][j], &g_remote_sockfds_events[i][j])) {
+                LOGERR("[main] failed to register to event: (%d) %s", errno, strerror(errno));
+                 return errno;
+            }
         }
     }
 
-    /* run event loop (blocking here) */
-    while (true) {
-        realtime = GetTime();
-        doevent();
-        realtime = GetTime();
+    /* kernel drops are reported relative to the startup (the freebsd counter is host-wide) */
+    get_udp_drops(g_bind_sockfd, &g_kernel_drops_base);
+    if (g_stats_interval_sec) {
+        timer_init(&g_stats_timer);
+        timer_start(&g_stats_timer, handle_stats_event, g_stats_interval_sec * 1000, g_stats_interval_sec * 1000);
+        LOGINF("[main] log the counters every %ld seconds", (long)g_stats_interval_sec);
+    }
+
+    msgbatch_init(&g_rxbatch);
+    msgbatch_init(&g_local_txbatch);
+    for (int i = 0; i < SERVER_MAXCOUNT; ++i) msgbatch_init(&g_remote_txbatches[i]);
+    if (g_batch_size > 1) LOGINF("[main] up to %hhu datagrams per recvmmsg/sendmmsg", g_batch_size);
+    if (g_cpu_affinity >= 0 && set_cpu_affinity(g_cpu_affinity)) LOGINF("[main] pinned to cpu %d", g_cpu_affinity);
+    if (g_busy_poll_usec) LOGINF("[main] busy poll: spin %u usec after the last packet", g_busy_poll_usec);
+
+    /* run event loop: block until a packet or the next timer; with busy poll, spin while packets keep coming */
+    uint64_t last_event_time = 0;
+    while (!g_shutdown_signal) {
+        UpdateRealTime();
+        log_tick(GetWallTime());
+        bool is_spinning = g_busy_poll_usec && GetTimeUs() - last_event_time < g_busy_poll_usec;
+        if (doevent(is_spinning ? 0 : event_wait_timeout()) > 0) last_event_time = GetTimeUs();
+        UpdateRealTime();
         run_timers();
-        usleep(1000);
+        flush_pending_sends(); /* sent by the timers: repeats and prefetch */
+        if (g_stats_signal) {
+            g_stats_signal = 0;
+            log_stats();
+        }
+        log_flush(); /* idle time: write out the batched log lines */
+        tap_flush();
     }
 
-    return 0;
+    LOGINF("[main] received signal %d, shutting down", (int)g_shutdown_signal);
+    log_stats();
+    if (g_cache_fname) {
+        ssize_t count = cache_dump(g_cache_fname);
+        if (count >= 0) LOGINF("[main] dumped %zd cache entries to %s", count, g_cache_fname);
+    }
+    return 0; /* exit handlers flush the log, the tap and the prefetch table */
 }
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <arpa/inet.h>
 #include "dnlutils.h"
 #include "dnsutils.h"
 #include "logutils.h"
@@ -11,6 +12,7 @@
 
 /* a very simple memory pool (alloc only) */
 static void* mempool_alloc(size_t length) {
+    length = (length + 7) & ~(size_t)7; /* keep the entries pointer-aligned */
     static void  *mempool_buffer = NULL;
     static size_t mempool_length = 0;
     if (mempool_length < length) {
@@ -23,33 +25,32 @@ static void* mempool_alloc(size_t length) {
     return mempool_buffer - length;
 }
 
-/* hash entry typedef */
+/* dnlentry_t.lists bits */
+#define DNL_LIST_GFW 0x1
+#define DNL_LIST_CHN 0x2
+
+/* hash entry typedef (gfwlist, chnlist and rules share one suffix index) */
 typedef struct {
     myhash_hh hh; /* TODO replace uthash to reduce memory usage */
+    const dnlanswer_t *answer; /* addresses of a DNL_MRESULT_ANSWER rule */
+    uint8_t lists; /* DNL_LIST_* bits */
+    uint8_t rule; /* DNL_MRESULT_* of the rule, NOMATCH: no rule */
     char dname[];
 } dnlentry_t;
 
 /* hash table (head entry) */
-static dnlentry_t *g_gfwlist_headentry = NULL;
-static dnlentry_t *g_chnlist_headentry = NULL;
+static dnlentry_t *g_dnl_headentry = NULL;
 
 // "www.google.com.hk"
 #define LABEL_MAXCNT 4
 
 // "a.www.google.com.hk" => "www.google.com.hk"
 static const char * dname_trim(const char *dname) {
-    unsigned dnamelen = strlen(dname);
-    if (dnamelen < 1 || dname[0] == '.' || dname[dnamelen - 1] == '.') return NULL;
+    if (!dns_dname_check(dname) || strcmp(dname, ".") == 0) return NULL;
 
-    unsigned labellen = 0, count = 0;
-    for (int i = dnamelen - 1; i >= 0; --i) {
-        if (dname[i] != '.') {
-            if (++labellen > DNS_DNAME_LABEL_MAXLEN) return NULL;
-        } else {
-            if (labellen < 1) return NULL;
-            labellen = 0;
-            if (++count >= LABEL_MAXCNT) return dname + i + 1;
-        }
+    unsigned count = 0;
+    for (int i = strlen(dname) - 1; i >= 0; --i) {
+        if (dname[i] == '.' && ++count >= LABEL_MAXCNT) return dname + i + 1;
     }
     return dname;
 }
@@ -87,6 +88,22 @@ static unsigned dname_split(const char *dname, unsigned dnamelen, const char *su
     return ++arraylen;
 }
 
+/* get the entry of `dname`, created if not exists */
+static dnlentry_t *dnl_entry(const char *dname) {
+    dnlentry_t *entry = NULL;
+    unsigned dnamelen = strlen(dname);
+    MYHASH_GET(g_dnl_headentry, entry, dname, dnamelen);
+    if (entry) return entry;
+
+    entry = mempool_alloc(sizeof(dnlentry_t) + dnamelen); //without \0
+    entry->answer = NULL;
+    entry->lists = 0;
+    entry->rule = DNL_MRESULT_NOMATCH;
+    memcpy(entry->dname, dname, dnamelen);
+    MYHASH_ADD(g_dnl_headentry, entry, entry->dname, dnamelen); //keyptr usually points to the inside of the structure
+    return entry;
+}
+
 /* initialize domain-name-list from file */
 size_t dnl_init(const char *filename, bool is_gfwlist) {
     FILE *fp = NULL;
@@ -100,63 +117,114 @@ size_t dnl_init(const char *filename, bool is_gfwlist) {
         }
     }
 
-    dnlentry_t **headentry = is_gfwlist ? &g_gfwlist_headentry : &g_chnlist_headentry;
+    uint8_t list = is_gfwlist ? DNL_LIST_GFW : DNL_LIST_CHN;
     char strbuf[DNS_DOMAIN_NAME_MAXLEN]; //254(include \0)
     while (fscanf(fp, "%253s", strbuf) > 0) {
         const char *dname = dname_trim(strbuf);
         if (!dname) continue;
-
-        dnlentry_t *entry = NULL;
-        unsigned dnamelen = strlen(dname);
-        MYHASH_GET(*headentry, entry, dname, dnamelen);
-        if (entry) continue;
-
-        entry = mempool_alloc(sizeof(dnlentry_t) + dnamelen); //without \0
-        memcpy(entry->dname, dname, dnamelen);
-        MYHASH_ADD(*headentry, entry, entry->dname, dnamelen); //keyptr usually points to the inside of the structure
+        dnl_entry(dname)->lists |= list;
     }
     if (fp != stdin) fclose(fp);
 
-    //remove duplicate dnames
+    //remove duplicate dnames (a parent domain is in the same list)
+    size_t count = 0;
     const char *sub_dnames[LABEL_MAXCNT - 1];
     unsigned sub_dnamelens[LABEL_MAXCNT - 1];
     dnlentry_t *curentry = NULL, *tmpentry = NULL;
-    MYHASH_FOR(*headentry, curentry, tmpentry) {
+    MYHASH_FOR(g_dnl_headentry, curentry, tmpentry) {
+        if (!(curentry->lists & list)) continue;
         unsigned arraylen = dname_subsplit(curentry->dname, curentry->hh.keylen, sub_dnames, sub_dnamelens);
         for (unsigned i = 0; i < arraylen; ++i) {
             dnlentry_t *findentry = NULL;
-            MYHASH_GET(*headentry, findentry, sub_dnames[i], sub_dnamelens[i]);
-            if (findentry) {
-                MYHASH_DEL(*headentry, curentry);
+            MYHASH_GET(g_dnl_headentry, findentry, sub_dnames[i], sub_dnamelens[i]);
+            if (findentry && (findentry->lists & list)) {
+                curentry->lists &= ~list;
                 break;
             }
         }
+        if (curentry->lists & list) {
+            ++count;
+        } else if (!curentry->lists && !curentry->rule) {
+            MYHASH_DEL(g_dnl_headentry, curentry);
+        }
     }
-    return MYHASH_CNT(*headentry);
+    return count;
 }
 
-/* check if the given domain name matches */
-uint8_t dnl_ismatch(const char *dname, bool is_gfwlist_first) {
+/* parse the action of a rule ("china", "trust", "block" or "ip[,ip]"), return DNL_MRESULT_* or NOMATCH if invalid */
+static uint8_t dnl_rule_parse(char *action, const dnlanswer_t **answer) {
+    if (strcmp(action, "china") == 0) return DNL_MRESULT_CHNLIST;
+    if (strcmp(action, "trust") == 0) return DNL_MRESULT_GFWLIST;
+    if (strcmp(action, "block") == 0) return DNL_MRESULT_BLOCK;
+
+    dnlanswer_t addrs = {0};
+    for (char *ipstr = strtok(action, ","); ipstr; ipstr = strtok(NULL, ",")) {
+        if (inet_pton(AF_INET, ipstr, addrs.ip4) == 1) {
+            addrs.has_ip4 = true;
+        } else if (inet_pton(AF_INET6, ipstr, addrs.ip6) == 1) {
+            addrs.has_ip6 = true;
+        } else {
+            return DNL_MRESULT_NOMATCH;
+        }
+    }
+    if (!addrs.has_ip4 && !addrs.has_ip6) return DNL_MRESULT_NOMATCH;
+    dnlanswer_t *newanswer = mempool_alloc(sizeof(dnlanswer_t));
+    memcpy(newanswer, &addrs, sizeof(dnlanswer_t));
+    *answer = newanswer;
+    return DNL_MRESULT_ANSWER;
+}
+
+/* load the routing rules from file ("<domain-suffix> <china|trust|block|ip[,ip]>" per line) */
+size_t dnl_rule_init(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        LOGERR("[dnl_rule_init] failed to open '%s': (%d) %s", filename, errno, strerror(errno));
+        exit(errno);
+    }
+
+    size_t count = 0;
+    char linebuf[512];
+    for (unsigned lineno = 1; fgets(linebuf, sizeof(linebuf), fp); ++lineno) {
+        char dnamebuf[DNS_DOMAIN_NAME_MAXLEN], actionbuf[256];
+        int fields = sscanf(linebuf, "%253s %255s", dnamebuf, actionbuf);
+        if (fields <= 0 || dnamebuf[0] == '#') continue; /* blank line or comment */
+
+        const char *dname = dname_trim(dnamebuf);
+        const dnlanswer_t *answer = NULL;
+        uint8_t rule = fields == 2 ? dnl_rule_parse(actionbuf, &answer) : DNL_MRESULT_NOMATCH;
+        if (dname != dnamebuf || rule == DNL_MRESULT_NOMATCH) { /* a rule cannot be widened like the lists */
+            LOGERR("[dnl_rule_init] invalid rule at %s:%u, ignored", filename, lineno);
+            continue;
+        }
+        dnlentry_t *entry = dnl_entry(dname);
+        if (!entry->rule) ++count;
+        entry->rule = rule;
+        entry->answer = answer;
+    }
+    fclose(fp);
+    return count;
+}
+
+/* check if the given domain name matches, `answer` is set for DNL_MRESULT_ANSWER */
+uint8_t dnl_ismatch(const char *dname, bool is_gfwlist_first, const dnlanswer_t **answer) {
     const char *sub_dnames[LABEL_MAXCNT];
     unsigned sub_dnamelens[LABEL_MAXCNT];
     unsigned arraylen = dname_split(dname, strlen(dname), sub_dnames, sub_dnamelens);
     if (arraylen <= 0) return DNL_MRESULT_NOMATCH;
 
-    dnlentry_t *headentry = is_gfwlist_first ? g_gfwlist_headentry : g_chnlist_headentry;
-    if (headentry) {
-        for (unsigned i = 0; i < arraylen; ++i) {
-            dnlentry_t *findentry = NULL;
-            MYHASH_GET(headentry, findentry, sub_dnames[i], sub_dnamelens[i]);
-            if (findentry) return is_gfwlist_first ? DNL_MRESULT_GFWLIST : DNL_MRESULT_CHNLIST;
-        }
-    }
-    headentry = is_gfwlist_first ? g_chnlist_headentry : g_gfwlist_headentry;
-    if (headentry) {
-        for (unsigned i = 0; i < arraylen; ++i) {
-            dnlentry_t *findentry = NULL;
-            MYHASH_GET(headentry, findentry, sub_dnames[i], sub_dnamelens[i]);
-            if (findentry) return is_gfwlist_first ? DNL_MRESULT_CHNLIST : DNL_MRESULT_GFWLIST;
+    /* one probe per suffix: the longest rule wins, otherwise the lists by priority */
+    uint8_t lists = 0;
+    for (int i = arraylen - 1; i >= 0; --i) {
+        dnlentry_t *findentry = NULL;
+        MYHASH_GET(g_dnl_headentry, findentry, sub_dnames[i], sub_dnamelens[i]);
+        if (!findentry) continue;
+        if (findentry->rule) {
+            if (answer) *answer = findentry->answer;
+            return findentry->rule;
         }
+        lists |= findentry->lists;
     }
+    if (lists & (is_gfwlist_first ? DNL_LIST_GFW : DNL_LIST_CHN)) return is_gfwlist_first ? DNL_MRESULT_GFWLIST : DNL_MRESULT_CHNLIST;
+    if (lists & (is_gfwlist_first ? DNL_LIST_CHN : DNL_LIST_GFW)) return is_gfwlist_first ? DNL_MRESULT_CHNLIST : DNL_MRESULT_GFWLIST;
     return DNL_MRESULT_NOMATCH;
 }
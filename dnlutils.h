@@ -9,13 +9,26 @@
 
 /* dnl_ismatch() return value */
 #define DNL_MRESULT_NOMATCH 0 // did not match
-#define DNL_MRESULT_GFWLIST 1 // hit the gfwlist
-#define DNL_MRESULT_CHNLIST 2 // hit the chnlist
+#define DNL_MRESULT_GFWLIST 1 // hit the gfwlist (or a `trust` rule)
+#define DNL_MRESULT_CHNLIST 2 // hit the chnlist (or a `china` rule)
+#define DNL_MRESULT_BLOCK   3 // hit a `block` rule
+#define DNL_MRESULT_ANSWER  4 // hit a rule with fixed addresses
+
+/* fixed addresses of a DNL_MRESULT_ANSWER rule */
+typedef struct {
+    bool    has_ip4;
+    bool    has_ip6;
+    uint8_t ip4[4];
+    uint8_t ip6[16];
+} dnlanswer_t;
 
 /* initialize domain-name-list from file */
 size_t dnl_init(const char *filename, bool is_gfwlist);
 
-/* check if the given domain name matches */
-uint8_t dnl_ismatch(const char *dname, bool is_gfwlist_first);
+/* load the routing rules from file ("<domain-suffix> <china|trust|block|ip[,ip]>" per line) */
+size_t dnl_rule_init(const char *filename);
+
+/* check if the given domain name matches, `answer` is set for DNL_MRESULT_ANSWER */
+uint8_t dnl_ismatch(const char *dname, bool is_gfwlist_first, const dnlanswer_t **answer);
 
 #endif
@@ -4,6 +4,7 @@
 #include "logutils.h"
 #include "chinadns.h"
 #include <string.h>
+#include <ctype.h>
 #include <netinet/in.h>
 #undef _GNU_SOURCE
 
@@ -94,8 +95,8 @@ static bool dns_packet_check(const void *packet_buf, ssize_t packet_len, char *n
     return true;
 }
 
-/* check the ipaddr of the first A/AAAA record is in `chnroute` ipset */
-static bool dns_ipset_check(const void *packet_ptr, const void *ans_ptr, ssize_t ans_len) {
+/* look up the ipaddr of the first A/AAAA record in `chnroute` ipset, return DNS_IPSET_* */
+static int dns_ipset_lookup(const void *packet_ptr, const void *ans_ptr, ssize_t ans_len) {
     const dns_header_t *header = packet_ptr;
 
     /* count number of answers */
@@ -103,13 +104,13 @@ static bool dns_ipset_check(const void *packet_ptr, const void *ans_ptr, ssize_t
 
     /* check dns packet length */
     if (ans_len < answer_count * ((ssize_t)sizeof(dns_record_t) + 1)) {
-        LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-        return false;
+        LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+        return DNS_IPSET_INVALID;
     }
 
     /* only filter A/AAAA reply */
     uint16_t qtype = ntohs(((dns_query_t *)(ans_ptr - sizeof(dns_query_t)))->qtype);
-    if (qtype != DNS_RECORD_TYPE_A && qtype != DNS_RECORD_TYPE_AAAA) return true;
+    if (qtype != DNS_RECORD_TYPE_A && qtype != DNS_RECORD_TYPE_AAAA) return DNS_IPSET_NOTADDR;
 
     /* find the first A/AAAA record */
     for (uint16_t i = 0; i < answer_count; ++i) {
@@ -119,64 +120,64 @@ static bool dns_ipset_check(const void *packet_ptr, const void *ans_ptr, ssize_t
                 ans_ptr += 2;
                 ans_len -= 2;
                 if (ans_len < (ssize_t)sizeof(dns_record_t)) {
-                    LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-                    return false;
+                    LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+                    return DNS_IPSET_INVALID;
                 }
                 break;
             }
             if (label_len > DNS_DNAME_LABEL_MAXLEN) {
-                LOGERR("[dns_ipset_check] the length of the domain name label is too long");
-                return false;
+                LOGERR("[dns_ipset_lookup] the length of the domain name label is too long");
+                return DNS_IPSET_INVALID;
             }
             if (label_len == 0) {
                 ++ans_ptr;
                 --ans_len;
                 if (ans_len < (ssize_t)sizeof(dns_record_t)) {
-                    LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-                    return false;
+                    LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+                    return DNS_IPSET_INVALID;
                 }
                 break;
             }
             ans_ptr += label_len + 1;
             ans_len -= label_len + 1;
             if (ans_len < (ssize_t)sizeof(dns_record_t) + 1) {
-                LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-                return false;
+                LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+                return DNS_IPSET_INVALID;
             }
         }
         const dns_record_t *record = ans_ptr;
         if (ntohs(record->rclass) != DNS_CLASS_INTERNET) {
-            LOGERR("[dns_ipset_check] only supports standard internet query class");
-            return false;
+            LOGERR("[dns_ipset_lookup] only supports standard internet query class");
+            return DNS_IPSET_INVALID;
         }
         uint16_t rdatalen = ntohs(record->rdatalen);
         if (ans_len < (ssize_t)sizeof(dns_record_t) + rdatalen) {
-            LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-            return false;
+            LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+            return DNS_IPSET_INVALID;
         }
         switch (ntohs(record->rtype)) {
             case DNS_RECORD_TYPE_A:
                 if (rdatalen != IPV4_BINADDR_LEN) {
-                    LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-                    return false;
+                    LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+                    return DNS_IPSET_INVALID;
                 }
-                return ipset_addr_is_exists(record->rdataptr, true); /* in chnroute? */
+                return ipset_addr_is_exists(record->rdataptr, true) ? DNS_IPSET_CHNIP : DNS_IPSET_FOREIGNIP; /* in chnroute? */
             case DNS_RECORD_TYPE_AAAA:
                 if (rdatalen != IPV6_BINADDR_LEN) {
-                    LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-                    return false;
+                    LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+                    return DNS_IPSET_INVALID;
                 }
-                return ipset_addr_is_exists(record->rdataptr, false); /* in chnroute6? */
+                return ipset_addr_is_exists(record->rdataptr, false) ? DNS_IPSET_CHNIP : DNS_IPSET_FOREIGNIP; /* in chnroute6? */
             default:
                 ans_ptr += sizeof(dns_record_t) + rdatalen;
                 ans_len -= sizeof(dns_record_t) + rdatalen;
                 if (i != answer_count - 1 && ans_len < (ssize_t)sizeof(dns_record_t) + 1) {
-                    LOGERR("[dns_ipset_check] the format of the dns packet is incorrect");
-                    return false;
+                    LOGERR("[dns_ipset_lookup] the format of the dns packet is incorrect");
+                    return DNS_IPSET_INVALID;
                 }
         }
     }
-    return g_noip_as_chnip; /* not found A/AAAA record */
+    return DNS_IPSET_NOIP; /* not found A/AAAA record */
 }
 
 /* check dns query, `name_buf` used to get domain name, return true if valid */
@@ -191,5 +192,305 @@ bool dns_query_check(const void *packet_buf, ssize_t packet_len, char *name_buf,
 bool dns_reply_check(const void *packet_buf, ssize_t packet_len, char *name_buf, bool chk_ipset) {
     const void *answer_ptr = NULL;
     if (!dns_packet_check(packet_buf, packet_len, name_buf, false, &answer_ptr)) return false;
-    return chk_ipset ? dns_ipset_check(packet_buf, answer_ptr, packet_len - (answer_ptr - packet_buf)) : true;
+    if (!chk_ipset) return true;
+    int ipset_ret = dns_ipset_lookup(packet_buf, answer_ptr, packet_len - (answer_ptr - packet_buf));
+    return ipset_ret == DNS_IPSET_CHNIP || ipset_ret == DNS_IPSET_NOTADDR || (ipset_ret == DNS_IPSET_NOIP && g_noip_as_chnip);
+}
+
+/* check dns reply and look up its first A/AAAA address in `chnroute` ipset, `name_buf` used to get domain name, return DNS_IPSET_* */
+int dns_reply_ipset(const void *packet_buf, ssize_t packet_len, char *name_buf) {
+    const void *answer_ptr = NULL;
+    if (!dns_packet_check(packet_buf, packet_len, name_buf, false, &answer_ptr)) return DNS_IPSET_INVALID;
+    return dns_ipset_lookup(packet_buf, answer_ptr, packet_len - (answer_ptr - packet_buf));
+}
+
+/* skip a (possibly compressed) name, return its length in the packet or -1 */
+static ssize_t dns_name_skip(const void *ptr, ssize_t len) {
+    ssize_t skip_len = 0;
+    while (skip_len < len) {
+        uint8_t label_len = *(uint8_t *)(ptr + skip_len);
+        if (label_len >= DNS_DNAME_COMPRESSION_MINVAL) return skip_len + 2 <= len ? skip_len + 2 : -1;
+        if (label_len > DNS_DNAME_LABEL_MAXLEN) return -1;
+        skip_len += label_len + 1;
+        if (label_len == 0) return skip_len;
+    }
+    return -1;
+}
+
+/* locate the OPT record of a checked packet, `*opt_ptr` is NULL if there is none */
+static bool dns_opt_locate(const void *packet_buf, ssize_t packet_len, const void **opt_ptr, ssize_t *opt_len) {
+    const dns_header_t *header = packet_buf;
+    const void *ptr = packet_buf + sizeof(dns_header_t);
+    ptr = memchr(ptr, 0, packet_len - sizeof(dns_header_t)) + 1 + sizeof(dns_query_t); /* question */
+    ssize_t len = packet_len - (ptr - packet_buf);
+    unsigned record_count = ntohs(header->answer_count) + ntohs(header->authority_count) + ntohs(header->additional_count);
+    unsigned additional_idx = record_count - ntohs(header->additional_count);
+    *opt_ptr = NULL;
+    for (unsigned i = 0; i < record_count; ++i) {
+        ssize_t name_len = dns_name_skip(ptr, len);
+        if (name_len < 0 || len - name_len < (ssize_t)sizeof(dns_record_t)) return false;
+        const dns_record_t *record = ptr + name_len;
+        ssize_t record_len = name_len + sizeof(dns_record_t) + ntohs(record->rdatalen);
+        if (record_len > len) return false;
+        if (i >= additional_idx && ntohs(record->rtype) == DNS_RECORD_TYPE_OPT && name_len == 1) {
+            *opt_ptr = ptr;
+            *opt_len = record_len;
+        }
+        ptr += record_len;
+        len -= record_len;
+    }
+    return true;
+}
+
+/* remove the OPT record (if any) and append a new one built from `udpsize`, `ttl` and `options` */
+static ssize_t dns_opt_replace(void *packet_buf, ssize_t packet_len, size_t buf_size, void *opt_ptr, ssize_t opt_len,
+                               uint16_t udpsize, uint32_t ttl, const void *options, size_t options_len) {
+    dns_header_t *header = packet_buf;
+    if (opt_ptr) {
+        memmove(opt_ptr, opt_ptr + opt_len, packet_len - (opt_ptr - packet_buf) - opt_len);
+        packet_len -= opt_len;
+    } else {
+        header->additional_count = htons(ntohs(header->additional_count) + 1);
+    }
+    if ((size_t)packet_len + 1 + sizeof(dns_record_t) + options_len > buf_size) return -1;
+    void *ptr = packet_buf + packet_len;
+    *(uint8_t *)ptr = 0; /* root name */
+    dns_record_t *record = ptr + 1;
+    record->rtype = htons(DNS_RECORD_TYPE_OPT);
+    record->rclass = htons(udpsize);
+    record->rttl = ttl; /* extended-rcode, version, flags (network order, copied as-is) */
+    record->rdatalen = htons(options_len);
+    memmove(record->rdataptr, options, options_len);
+    return packet_len + 1 + sizeof(dns_record_t) + options_len;
+}
+
+/* hash of the question (name case-insensitive), safe on unchecked packets, return 0 if malformed */
+uint32_t dns_question_hash(const void *packet_buf, ssize_t packet_len) {
+    if (packet_len < (ssize_t)sizeof(dns_header_t) + (ssize_t)sizeof(dns_query_t) + 1) return 0;
+    const uint8_t *question = packet_buf + sizeof(dns_header_t);
+    const uint8_t *dname_endptr = memchr(question, 0, packet_len - sizeof(dns_header_t));
+    if (!dname_endptr || (const void *)(dname_endptr + 1 + sizeof(dns_query_t)) > packet_buf + packet_len) return 0;
+    uint32_t hash = 0x811c9dc5; /* fnv-1a */
+    for (const uint8_t *ptr = question; ptr < dname_endptr + 1 + sizeof(dns_query_t); ++ptr) {
+        hash ^= ptr < dname_endptr ? tolower(*ptr) : *ptr;
+        hash *= 0x01000193;
+    }
+    return hash ? hash : 1;
+}
+
+/* get the udp payload size of a checked query (512 if without OPT) and set it to `udpsize` (0: keep it) */
+uint16_t dns_edns_udpsize(void *packet_buf, ssize_t packet_len, uint16_t udpsize) {
+    void *opt_ptr = NULL;
+    ssize_t opt_len = 0;
+    if (!dns_opt_locate(packet_buf, packet_len, (const void **)&opt_ptr, &opt_len) || !opt_ptr) return DNS_EDNS_UDPSIZE_MIN;
+    dns_record_t *record = opt_ptr + 1;
+    uint16_t client_udpsize = ntohs(record->rclass);
+    if (udpsize) record->rclass = htons(udpsize); /* only rewritten in place, a query without OPT stays plain dns */
+    return client_udpsize < DNS_EDNS_UDPSIZE_MIN ? DNS_EDNS_UDPSIZE_MIN : client_udpsize;
+}
+
+/* what of a checked query changes the reply: OPT presence, DO bit and (`with_ecs`) the client subnet option, return the key length */
+size_t dns_edns_key(const void *packet_buf, ssize_t packet_len, bool with_ecs, uint8_t *key_buf) {
+    const void *opt_ptr = NULL;
+    ssize_t opt_len = 0;
+    key_buf[0] = 0; /* plain dns */
+    if (!dns_opt_locate(packet_buf, packet_len, &opt_ptr, &opt_len) || !opt_ptr) return 1;
+    const dns_record_t *record = opt_ptr + 1;
+    key_buf[0] = (((const uint8_t *)&record->rttl)[2] & 0x80) ? 2 : 1; /* ttl: extended-rcode, version, DO and z */
+    if (!with_ecs) return 1;
+    const uint8_t *optptr = record->rdataptr, *optend = record->rdataptr + ntohs(record->rdatalen);
+    while (optend - optptr >= 4) {
+        uint16_t optcode = (optptr[0] << 8) | optptr[1];
+        uint16_t optlen = (optptr[2] << 8) | optptr[3];
+        if (optend - optptr < 4 + optlen) break;
+        if (optcode == DNS_EDNS_OPTCODE_ECS && optlen <= DNS_EDNS_KEY_MAXLEN - 1) {
+            memcpy(key_buf + 1, optptr + 4, optlen);
+            return 1 + optlen;
+        }
+        optptr += 4 + optlen;
+    }
+    return 1;
+}
+
+/* cut a reply down to header, question and OPT record with TC set, return the new length or -1 */
+ssize_t dns_reply_truncate(void *packet_buf, ssize_t packet_len) {
+    if (packet_len < (ssize_t)sizeof(dns_header_t) + (ssize_t)sizeof(dns_query_t) + 1) return -1;
+    void *question_endptr = memchr(packet_buf + sizeof(dns_header_t), 0, packet_len - sizeof(dns_header_t));
+    if (!question_endptr || question_endptr + 1 + sizeof(dns_query_t) > packet_buf + packet_len) return -1;
+    question_endptr += 1 + sizeof(dns_query_t);
+    ssize_t truncated_len = question_endptr - packet_buf;
+    void *opt_ptr = NULL;
+    ssize_t opt_len = 0;
+    if (!dns_opt_locate(packet_buf, packet_len, (const void **)&opt_ptr, &opt_len)) opt_ptr = NULL;
+    dns_header_t *header = packet_buf;
+    if (opt_ptr) {
+        memmove(question_endptr, opt_ptr, opt_len);
+        truncated_len += opt_len;
+    }
+    header->tc = 1;
+    header->answer_count = 0;
+    header->authority_count = 0;
+    header->additional_count = htons(opt_ptr ? 1 : 0);
+    return truncated_len;
+}
+
+/* check the question and collect the offsets of the ttl fields (OPT record excluded) in one walk, return the count or -1 (malformed or > `max_count`) */
+int dns_ttl_offsets(const void *packet_buf, ssize_t packet_len, uint16_t offsets[], int max_count) {
+    const dns_header_t *header = packet_buf;
+    if (packet_len < (ssize_t)sizeof(dns_header_t) + 1 + (ssize_t)sizeof(dns_query_t) || header->question_count != htons(1)) return -1;
+    const void *ptr = memchr(packet_buf + sizeof(dns_header_t), 0, packet_len - sizeof(dns_header_t)); /* question: uncompressed name */
+    if (!ptr || ptr + 1 + sizeof(dns_query_t) > packet_buf + packet_len) return -1;
+    const dns_query_t *query = ptr + 1;
+    if (ntohs(query->qclass) != DNS_CLASS_INTERNET) return -1;
+    ptr = query + 1;
+    ssize_t len = packet_len - (ptr - packet_buf);
+    unsigned record_count = ntohs(header->answer_count) + ntohs(header->authority_count) + ntohs(header->additional_count);
+    int count = 0;
+    for (unsigned i = 0; i < record_count; ++i) {
+        ssize_t name_len = dns_name_skip(ptr, len);
+        if (name_len < 0 || len - name_len < (ssize_t)sizeof(dns_record_t)) return -1;
+        const dns_record_t *record = ptr + name_len;
+        ssize_t record_len = name_len + sizeof(dns_record_t) + ntohs(record->rdatalen);
+        if (record_len > len) return -1;
+        if (ntohs(record->rtype) != DNS_RECORD_TYPE_OPT) {
+            if (count >= max_count) return -1;
+            offsets[count++] = (const void *)&record->rttl - packet_buf;
+        }
+        ptr += record_len;
+        len -= record_len;
+    }
+    return count;
+}
+
+/* clamp the ttl fields at `offsets` (from dns_ttl_offsets) to [min_ttl, max_ttl] in place, `max_ttl` 0: no upper limit */
+void dns_ttl_clamp(void *packet_buf, const uint16_t offsets[], int count, uint32_t min_ttl, uint32_t max_ttl) {
+    for (int i = 0; i < count; ++i) {
+        uint32_t ttl;
+        memcpy(&ttl, packet_buf + offsets[i], sizeof(ttl));
+        uint32_t clamped = ntohl(ttl);
+        if (clamped < min_ttl) clamped = min_ttl;
+        if (max_ttl && clamped > max_ttl) clamped = max_ttl;
+        if (clamped == ntohl(ttl)) continue;
+        ttl = htonl(clamped);
+        memcpy(packet_buf + offsets[i], &ttl, sizeof(ttl));
+    }
+}
+
+/* turn a checked query into a reply with `rcode` and an answer record if `rdata` is not NULL, return the new length or -1 */
+ssize_t dns_reply_build(void *packet_buf, ssize_t packet_len, size_t buf_size, uint8_t rcode, uint16_t rtype, const void *rdata, uint16_t rdatalen, uint32_t ttl) {
+    ssize_t reply_len = dns_reply_truncate(packet_buf, packet_len); /* header, question and OPT */
+    if (reply_len < 0) return -1;
+    dns_header_t *header = packet_buf;
+    header->qr = DNS_QR_REPLY;
+    header->tc = 0;
+    header->ra = 1;
+    header->rcode = rcode;
+    if (!rdata) return reply_len;
+
+    ssize_t record_len = sizeof(uint16_t) + sizeof(dns_record_t) + rdatalen;
+    if (reply_len + record_len > (ssize_t)buf_size) return -1;
+    void *answer_ptr = memchr(packet_buf + sizeof(dns_header_t), 0, reply_len - sizeof(dns_header_t)) + 1 + sizeof(dns_query_t);
+    memmove(answer_ptr + record_len, answer_ptr, reply_len - (answer_ptr - packet_buf)); /* the OPT record */
+    uint16_t name_ptr = htons(DNS_DNAME_COMPRESSION_MINVAL << 8 | sizeof(dns_header_t)); /* -> the question name */
+    memcpy(answer_ptr, &name_ptr, sizeof(name_ptr));
+    dns_record_t *record = answer_ptr + sizeof(name_ptr);
+    record->rtype = htons(rtype);
+    record->rclass = htons(DNS_CLASS_INTERNET);
+    record->rttl = htonl(ttl);
+    record->rdatalen = htons(rdatalen);
+    memcpy(record->rdataptr, rdata, rdatalen);
+    header->answer_count = htons(1);
+    return reply_len + record_len;
+}
+
+/* check a dotted domain name ("." for the root): labels of 1-63 bytes, at most 253 bytes */
+bool dns_dname_check(const char *dname) {
+    size_t dnamelen = strlen(dname);
+    if (dnamelen < 1 || dnamelen >= DNS_DOMAIN_NAME_MAXLEN) return false;
+    if (dnamelen == 1 && dname[0] == '.') return true;
+    if (dname[0] == '.' || dname[dnamelen - 1] == '.') return false;
+    size_t labellen = 0;
+    for (size_t i = 0; i < dnamelen; ++i) {
+        if (dname[i] != '.') {
+            if (++labellen > DNS_DNAME_LABEL_MAXLEN) return false;
+        } else {
+            if (labellen < 1) return false;
+            labellen = 0;
+        }
+    }
+    return true;
+}
+
+/* build a recursive query for `dname` (msgid 0) into `packet_buf`, return the length */
+ssize_t dns_query_build(void *packet_buf, const char *dname, uint16_t qtype) {
+    dns_header_t *header = packet_buf;
+    memset(header, 0, sizeof(dns_header_t));
+    header->rd = 1;
+    header->question_count = htons(1);
+    uint8_t *ptr = packet_buf + sizeof(dns_header_t);
+    if (strcmp(dname, ".")) {
+        for (const char *label = dname, *dot = NULL; label; label = dot ? dot + 1 : NULL) {
+            dot = strchr(label, '.');
+            size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+            *ptr++ = label_len; /* "www.google.com" => "\3www\6google\3com" */
+            memcpy(ptr, label, label_len);
+            ptr += label_len;
+        }
+    }
+    *ptr++ = 0;
+    dns_query_t *query = (dns_query_t *)ptr;
+    query->qtype = htons(qtype);
+    query->qclass = htons(DNS_CLASS_INTERNET);
+    return ptr + sizeof(dns_query_t) - (uint8_t *)packet_buf;
+}
+
+/* set the client subnet option of a checked query (`family` 0: remove it), return new length or -1 */
+ssize_t dns_ecs_rewrite(void *packet_buf, ssize_t packet_len, size_t buf_size, int family, const void *addr, uint8_t prefix) {
+    void *opt_ptr = NULL;
+    ssize_t opt_len = 0;
+    if (!dns_opt_locate(packet_buf, packet_len, (const void **)&opt_ptr, &opt_len)) {
+        LOGERR("[dns_ecs_rewrite] the format of the dns packet is incorrect");
+        return -1;
+    }
+    if (!opt_ptr && family == 0) return packet_len; /* nothing to remove */
+
+    uint16_t udpsize = DNS_EDNS_UDPSIZE_MIN;
+    uint32_t ttl = 0;
+    uint8_t options[DNS_PACKET_MAXSIZE];
+    size_t options_len = 0;
+
+    /* keep every option except the old client subnet */
+    if (opt_ptr) {
+        const dns_record_t *record = opt_ptr + 1;
+        udpsize = ntohs(record->rclass);
+        ttl = record->rttl;
+        const uint8_t *optptr = record->rdataptr, *optend = record->rdataptr + ntohs(record->rdatalen);
+        while (optend - optptr >= 4) {
+            uint16_t optcode = (optptr[0] << 8) | optptr[1];
+            uint16_t optlen = (optptr[2] << 8) | optptr[3];
+            if (optend - optptr < 4 + optlen) break;
+            if (optcode != DNS_EDNS_OPTCODE_ECS) {
+                memcpy(options + options_len, optptr, 4 + optlen);
+                options_len += 4 + optlen;
+            }
+            optptr += 4 + optlen;
+        }
+    }
+
+    /* family, source prefix, scope prefix (0), address truncated to the prefix */
+    if (family) {
+        uint8_t addr_len = (prefix + 7) / 8;
+        uint8_t *ecs = options + options_len;
+        ecs[0] = 0; ecs[1] = DNS_EDNS_OPTCODE_ECS;
+        ecs[2] = 0; ecs[3] = 4 + addr_len;
+        ecs[4] = 0; ecs[5] = family == AF_INET ? 1 : 2;
+        ecs[6] = prefix;
+        ecs[7] = 0;
+        memcpy(ecs + 8, addr, addr_len);
+        if (prefix % 8) ecs[8 + addr_len - 1] &= (uint8_t)(0xff << (8 - prefix % 8));
+        options_len += 8 + addr_len;
+    }
+
+    if (!opt_ptr && options_len == 0) return packet_len;
+    return dns_opt_replace(packet_buf, packet_len, buf_size, opt_ptr, opt_len, udpsize, ttl, options, options_len);
 }
@@ -24,7 +24,10 @@
 #endif
 
 /* dns packet max size (in bytes) */
-#define DNS_PACKET_MAXSIZE 1472 /* compatible with edns */
+#define DNS_PACKET_MAXSIZE 4096 /* largest edns udp payload we accept */
+
+/* max records in a packet (bounds the rr offset arrays) */
+#define DNS_RECORD_MAXCOUNT (DNS_PACKET_MAXSIZE / 11) /* smallest record: root name (1) and fixed part (10) */
 
 /* domain name max len (including separator '.' and '\0') */
 /* example: "www.example.com", length = 16 (including '\0') */
@@ -34,10 +37,16 @@
 #define DNS_QR_REPLY 1
 #define DNS_OPCODE_QUERY 0
 #define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
 #define DNS_RCODE_REFUSED 5
 #define DNS_CLASS_INTERNET 1
 #define DNS_RECORD_TYPE_A 1 /* ipv4 address */
 #define DNS_RECORD_TYPE_AAAA 28 /* ipv6 address */
+#define DNS_RECORD_TYPE_OPT 41 /* edns pseudo-record */
+#define DNS_EDNS_OPTCODE_ECS 8 /* edns client subnet (rfc7871) */
+#define DNS_EDNS_UDPSIZE_MIN 512 /* udp payload size without edns */
+#define DNS_EDNS_UDPSIZE_MAX DNS_PACKET_MAXSIZE /* udp payload size limit of the buffers */
+#define DNS_EDNS_KEY_MAXLEN 21 /* dns_edns_key(): flags (1) and the client subnet option data (family, prefixes, address: 4 + 16) */
 #define DNS_DNAME_LABEL_MAXLEN 63 /* domain-name label maxlen */
 #define DNS_DNAME_COMPRESSION_MINVAL 192 /* domain-name compression minval */
 
@@ -88,10 +97,50 @@ typedef struct {
     uint8_t  rdataptr[]; // record data pointer (sizeof=0)
 } __attribute__((packed)) dns_record_t;
 
+/* dns_reply_ipset() return value */
+#define DNS_IPSET_INVALID  -1 // malformed reply
+#define DNS_IPSET_NOTADDR   0 // not an A/AAAA query
+#define DNS_IPSET_NOIP      1 // without A/AAAA record
+#define DNS_IPSET_CHNIP     2 // the first address is in chnroute
+#define DNS_IPSET_FOREIGNIP 3 // the first address is not in chnroute
+
 /* check dns query, `name_buf` used to get domain name, return true if valid */
 bool dns_query_check(const void *packet_buf, ssize_t packet_len, char *name_buf, uint16_t *qtype);
 
 /* check dns reply, `name_buf` used to get domain name, return true if accept */
 bool dns_reply_check(const void *packet_buf, ssize_t packet_len, char *name_buf, bool chk_ipset);
 
+/* check dns reply and look up its first A/AAAA address in `chnroute` ipset, `name_buf` used to get domain name, return DNS_IPSET_* */
+int dns_reply_ipset(const void *packet_buf, ssize_t packet_len, char *name_buf);
+
+/* hash of the question (name case-insensitive), safe on unchecked packets, return 0 if malformed */
+uint32_t dns_question_hash(const void *packet_buf, ssize_t packet_len);
+
+/* get the udp payload size of a checked query (512 if without OPT) and set it to `udpsize` (0: keep it) */
+uint16_t dns_edns_udpsize(void *packet_buf, ssize_t packet_len, uint16_t udpsize);
+
+/* what of a checked query changes the reply: OPT presence, DO bit and (`with_ecs`) the client subnet option, return the key length */
+size_t dns_edns_key(const void *packet_buf, ssize_t packet_len, bool with_ecs, uint8_t *key_buf);
+
+/* cut a reply down to header, question and OPT record with TC set, return the new length or -1 */
+ssize_t dns_reply_truncate(void *packet_buf, ssize_t packet_len);
+
+/* check the question and collect the offsets of the ttl fields (OPT record excluded) in one walk, return the count or -1 (malformed or > `max_count`) */
+int dns_ttl_offsets(const void *packet_buf, ssize_t packet_len, uint16_t offsets[], int max_count);
+
+/* clamp the ttl fields at `offsets` (from dns_ttl_offsets) to [min_ttl, max_ttl] in place, `max_ttl` 0: no upper limit */
+void dns_ttl_clamp(void *packet_buf, const uint16_t offsets[], int count, uint32_t min_ttl, uint32_t max_ttl);
+
+/* turn a checked query into a reply with `rcode` and an answer record if `rdata` is not NULL, return the new length or -1 */
+ssize_t dns_reply_build(void *packet_buf, ssize_t packet_len, size_t buf_size, uint8_t rcode, uint16_t rtype, const void *rdata, uint16_t rdatalen, uint32_t ttl);
+
+/* check a dotted domain name ("." for the root): labels of 1-63 bytes, at most 253 bytes */
+bool dns_dname_check(const char *dname);
+
+/* build a recursive query for `dname` (msgid 0) into `packet_buf`, return the length */
+ssize_t dns_query_build(void *packet_buf, const char *dname, uint16_t qtype);
+
+/* set the client subnet option of a checked query (`family` 0: remove it), return new length or -1 */
+ssize_t dns_ecs_rewrite(void *packet_buf, ssize_t packet_len, size_t buf_size, int family, const void *addr, uint8_t prefix);
+
 #endif
@@ -7,7 +7,6 @@
 int event_ident;
 event_io_t **event_watchers;
 unsigned int event_nwatchers;
-extern uint64_t realtime;
 
 #define MAX_EVENTS 1024
 
@@ -20,7 +20,8 @@ int event_del(int fd);
 
 // void event_set(int fd, int filter, int flags, void *data);
 
-void doevent(void);
+/* wait up to timeout_ms (-1: forever) for the first batch, return the count of events handled */
+int doevent(int timeout_ms);
 
 
 extern int event_ident;
@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include "limitutils.h"
+#include "realtime.h"
+#include <stdlib.h>
+#include <string.h>
+#undef _GNU_SOURCE
+
+/* table size (power of 2) and the slots probed per lookup */
+#define RATELIMIT_SLOTS  8192
+#define RATELIMIT_PROBES 8
+
+/* tokens are counted in 1/1000 to refill per millisecond (rate and burst <= RATELIMIT_MAXRATE) */
+#define TOKEN_UNIT 1000
+
+/* bucket slot, `key` 0 means unused */
+typedef struct {
+    uint64_t key;
+    uint32_t tokens;    /* in TOKEN_UNIT */
+    uint32_t last_time; /* GetTime() (ms, truncated) of the last refill */
+} bucket_t;
+
+struct ratelimit {
+    uint32_t rate;      /* tokens per second (= TOKEN_UNIT per ms) */
+    uint32_t capacity;  /* burst in TOKEN_UNIT */
+    uint32_t idle_time; /* ms after which an idle bucket is full again, i.e. free to reuse */
+    bucket_t buckets[RATELIMIT_SLOTS];
+};
+
+/* create a table of buckets refilled at `rate` tokens per second, holding up to `burst` tokens */
+ratelimit_t *ratelimit_new(uint32_t rate, uint32_t burst) {
+    ratelimit_t *ratelimit = calloc(1, sizeof(ratelimit_t));
+    ratelimit->rate = rate;
+    ratelimit->capacity = burst * TOKEN_UNIT;
+    ratelimit->idle_time = (burst * 1000 + rate - 1) / rate;
+    return ratelimit;
+}
+
+/* take a token from the bucket of `key` (non-zero hash), return false if it is empty */
+bool ratelimit_allow(ratelimit_t *ratelimit, uint64_t key) {
+    uint32_t now = GetTime();
+    bucket_t *bucket = NULL, *victim = NULL;
+    for (uint32_t i = 0; i < RATELIMIT_PROBES; ++i) {
+        bucket_t *slot = &ratelimit->buckets[(key + i) & (RATELIMIT_SLOTS - 1)];
+        if (slot->key == key) {
+            bucket = slot;
+            break;
+        }
+        /* an unused or long idle slot can be taken over: its bucket would be full anyway */
+        if (!victim && (slot->key == 0 || now - slot->last_time >= ratelimit->idle_time)) victim = slot;
+        if (slot->key == 0) break;
+    }
+    if (!bucket) {
+        if (!victim) return true; /* probe window crowded with active clients: fail open */
+        victim->key = key;
+        victim->tokens = ratelimit->capacity;
+        victim->last_time = now;
+        bucket = victim;
+    }
+
+    uint64_t tokens = bucket->tokens + (uint64_t)(now - bucket->last_time) * ratelimit->rate;
+    bucket->tokens = tokens > ratelimit->capacity ? ratelimit->capacity : tokens;
+    bucket->last_time = now;
+    if (bucket->tokens < TOKEN_UNIT) return false;
+    bucket->tokens -= TOKEN_UNIT;
+    return true;
+}
+
+/* 64-bit fnv-1a hash of `data`, continuing from `hash` (start with RATELIMIT_HASH_INIT) */
+uint64_t ratelimit_hash(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *ptr = data;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= ptr[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
@@ -0,0 +1,27 @@
+#ifndef CHINADNS_NG_LIMITUTILS_H
+#define CHINADNS_NG_LIMITUTILS_H
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#undef _GNU_SOURCE
+
+/* token bucket table (fixed size, open addressing) */
+typedef struct ratelimit ratelimit_t;
+
+/* max rate and burst, keeps `burst` in 1/1000 tokens within uint32_t */
+#define RATELIMIT_MAXRATE 1000000
+
+/* create a table of buckets refilled at `rate` tokens per second, holding up to `burst` tokens */
+ratelimit_t *ratelimit_new(uint32_t rate, uint32_t burst);
+
+/* take a token from the bucket of `key` (non-zero hash), return false if it is empty */
+bool ratelimit_allow(ratelimit_t *ratelimit, uint64_t key);
+
+/* 64-bit fnv-1a hash of `data`, continuing from `hash` (start with RATELIMIT_HASH_INIT) */
+uint64_t ratelimit_hash(uint64_t hash, const void *data, size_t len);
+
+#define RATELIMIT_HASH_INIT 0xcbf29ce484222325ULL
+
+#endif
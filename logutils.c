@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+#include "logutils.h"
+#include "realtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#undef _GNU_SOURCE
+
+/* buffer size of each thread (flushed when free space < LOG_LINE_MAXLEN) */
+#define LOG_BUFFER_SIZE 65536
+#define LOG_LINE_MAXLEN 2048
+
+/* "2019-07-28 09:26:39\0" */
+#define LOG_TIMESTR_LEN 20
+
+/* log output buffer (one per thread) */
+typedef struct {
+    size_t length;
+    char   buffer[LOG_BUFFER_SIZE];
+} logbuf_t;
+
+static __thread logbuf_t g_log_buffer;
+
+static int    g_log_format                  = LOG_FORMAT_TEXT;
+static bool   g_log_color                   = true;
+static time_t g_log_timesec                 = 0;
+static char   g_log_timestr[LOG_TIMESTR_LEN] = "1970-01-01 00:00:00";
+
+static const char *const g_log_levelname[]  = {"INF", "ERR"};
+static const char *const g_log_levelcolor[] = {"\e[1;32m", "\e[1;35m"};
+
+/* select the output format and register the exit-time flush */
+void log_init(int format) {
+    g_log_format = format;
+    g_log_color = isatty(STDOUT_FILENO);
+    log_tick(GetWallTime());
+    atexit(log_flush);
+}
+
+/* refresh the cached timestamp (the string is rebuilt at most once per second) */
+void log_tick(time_t now) {
+    if (now == g_log_timesec) return;
+    g_log_timesec = now;
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char timestr[LOG_TIMESTR_LEN];
+    if (strftime(timestr, LOG_TIMESTR_LEN, "%Y-%m-%d %H:%M:%S", &tm)) memcpy(g_log_timestr, timestr, LOG_TIMESTR_LEN); /* else (year > 9999) keep the last one */
+}
+
+/* write out the buffered log lines in one batch (called at loop idle time) */
+void log_flush(void) {
+    logbuf_t *logbuf = &g_log_buffer;
+    size_t offset = 0;
+    while (offset < logbuf->length) {
+        ssize_t nwrite = write(STDOUT_FILENO, logbuf->buffer + offset, logbuf->length - offset);
+        if (nwrite < 0) {
+            if (errno == EINTR) continue;
+            break; /* nowhere to report it, drop the pending lines */
+        }
+        offset += nwrite;
+    }
+    logbuf->length = 0;
+}
+
+/* append `msg` as a json string body (without the quotes) */
+static size_t json_escape(char *dst, size_t dstlen, const char *msg) {
+    size_t len = 0;
+    for (; *msg && len + 6 < dstlen; ++msg) {
+        unsigned char c = *msg;
+        if (c == '"' || c == '\\') {
+            dst[len++] = '\\';
+            dst[len++] = c;
+        } else if (c < 0x20) {
+            len += sprintf(dst + len, "\\u%04x", c);
+        } else {
+            dst[len++] = c;
+        }
+    }
+    return len;
+}
+
+/* format a log line into the per-thread buffer (flushed when full or by log_flush) */
+void log_write(int level, const char *fmt, ...) {
+    logbuf_t *logbuf = &g_log_buffer;
+    if (LOG_BUFFER_SIZE - logbuf->length < LOG_LINE_MAXLEN) log_flush();
+
+    char *linebuf = logbuf->buffer + logbuf->length;
+    size_t linelen = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    if (g_log_format == LOG_FORMAT_JSON) {
+        char msgbuf[LOG_LINE_MAXLEN / 2];
+        vsnprintf(msgbuf, sizeof(msgbuf), fmt, ap);
+        linelen = sprintf(linebuf, "{\"time\":\"%s\",\"level\":\"%s\",\"msg\":\"", g_log_timestr, g_log_levelname[level]);
+        linelen += json_escape(linebuf + linelen, LOG_LINE_MAXLEN - linelen - 3, msgbuf);
+        linelen += sprintf(linebuf + linelen, "\"}\n");
+    } else {
+        if (g_log_color) {
+            linelen = sprintf(linebuf, "%s%s %s:\e[0m ", g_log_levelcolor[level], g_log_timestr, g_log_levelname[level]);
+        } else {
+            linelen = sprintf(linebuf, "%s %s: ", g_log_timestr, g_log_levelname[level]);
+        }
+        int msglen = vsnprintf(linebuf + linelen, LOG_LINE_MAXLEN - linelen - 1, fmt, ap);
+        if (msglen > 0) linelen += ((size_t)msglen < LOG_LINE_MAXLEN - linelen - 1) ? (size_t)msglen : LOG_LINE_MAXLEN - linelen - 2;
+        linebuf[linelen++] = '\n';
+    }
+    va_end(ap);
+    logbuf->length += linelen;
+}
@@ -6,22 +6,27 @@
 #include <time.h>
 #undef _GNU_SOURCE
 
-#define LOGINF(fmt, ...)                                                    \
-    do {                                                                    \
-        struct tm *tm = localtime(&(time_t){time(NULL)});                   \
-        printf("\e[1;32m%04d-%02d-%02d %02d:%02d:%02d INF:\e[0m " fmt "\n", \
-                tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,            \
-                tm->tm_hour,        tm->tm_min,     tm->tm_sec,             \
-                ##__VA_ARGS__);                                             \
-    } while (0)
-
-#define LOGERR(fmt, ...)                                                    \
-    do {                                                                    \
-        struct tm *tm = localtime(&(time_t){time(NULL)});                   \
-        printf("\e[1;35m%04d-%02d-%02d %02d:%02d:%02d ERR:\e[0m " fmt "\n", \
-                tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,            \
-                tm->tm_hour,        tm->tm_min,     tm->tm_sec,             \
-                ##__VA_ARGS__);                                             \
-    } while (0)
+/* log output format */
+#define LOG_FORMAT_TEXT 0 /* "date time LVL: msg" */
+#define LOG_FORMAT_JSON 1 /* {"time":"..","level":"..","msg":".."} */
+
+/* log level (index of the level table) */
+#define LOG_LEVEL_INF 0
+#define LOG_LEVEL_ERR 1
+
+/* select the output format and register the exit-time flush */
+void log_init(int format);
+
+/* refresh the cached timestamp (the string is rebuilt at most once per second) */
+void log_tick(time_t now);
+
+/* format a log line into the per-thread buffer (flushed when full or by log_flush) */
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* write out the buffered log lines in one batch (called at loop idle time) */
+void log_flush(void);
+
+#define LOGINF(fmt, ...) log_write(LOG_LEVEL_INF, fmt, ##__VA_ARGS__)
+#define LOGERR(fmt, ...) log_write(LOG_LEVEL_ERR, fmt, ##__VA_ARGS__)
 
 #endif
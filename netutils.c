@@ -14,6 +14,15 @@
 #include "radix.h"
 #include <err.h>
 #include <netdb.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#ifdef __FreeBSD__
+  #include <sys/sysctl.h>
+  #include <netinet/ip.h>
+  #include <netinet/ip_var.h>
+  #include <netinet/udp.h>
+  #include <netinet/udp_var.h>
+#endif
 
 /* since linux 3.9 */
 #ifndef SO_REUSEPORT
@@ -75,6 +84,95 @@ int new_udp_socket(int family) {
     return sockfd;
 }
 
+/* setsockopt(SO_RCVBUF/SO_SNDBUF) when size > 0, return the size in effect (the kernel may clamp or double it) */
+int set_socket_bufsize(int sockfd, int optname, int size) {
+    const char *optstr = optname == SO_RCVBUF ? "SO_RCVBUF" : "SO_SNDBUF";
+    if (size > 0 && setsockopt(sockfd, SOL_SOCKET, optname, &size, sizeof(size))) {
+        LOGERR("[set_socket_bufsize] setsockopt(%d, %s, %d): (%d) %s", sockfd, optstr, size, errno, strerror(errno));
+        exit(errno);
+    }
+    int effective = 0;
+    socklen_t optlen = sizeof(effective);
+    if (getsockopt(sockfd, SOL_SOCKET, optname, &effective, &optlen)) {
+        LOGERR("[set_socket_bufsize] getsockopt(%d, %s): (%d) %s", sockfd, optstr, errno, strerror(errno));
+        return size;
+    }
+    return effective;
+}
+
+/* setsockopt(SO_BUSY_POLL) where supported, false if unsupported or not permitted */
+bool set_busy_poll(int sockfd, int usec) {
+#ifdef SO_BUSY_POLL
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec))) {
+        LOGERR("[set_busy_poll] setsockopt(%d, SO_BUSY_POLL, %d): (%d) %s", sockfd, usec, errno, strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    (void)sockfd; (void)usec;
+    return false;
+#endif
+}
+
+/* kernel drops of received udp datagrams (socket buffer full), false if unavailable */
+bool get_udp_drops(int sockfd, uint64_t *drops) {
+#if defined(__FreeBSD__)
+    (void)sockfd; /* no per-socket counter: host-wide "dropped due to full socket buffers" */
+    struct udpstat udpstat;
+    size_t len = sizeof(udpstat);
+    if (sysctlbyname("net.inet.udp.stats", &udpstat, &len, NULL, 0)) return false;
+    *drops = udpstat.udps_fullsock;
+    return true;
+#elif defined(__linux__)
+    /* the "drops" column of the socket's line (matched by inode) */
+    struct stat st;
+    if (fstat(sockfd, &st)) return false;
+    const char *fnames[] = {"/proc/net/udp", "/proc/net/udp6"};
+    for (size_t i = 0; i < sizeof(fnames) / sizeof(*fnames); ++i) {
+        FILE *fp = fopen(fnames[i], "r");
+        if (!fp) continue;
+        char line[512];
+        unsigned long inode = 0, count = 0;
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %lu %*s %*s %lu", &inode, &count) == 2 && inode == st.st_ino) {
+                fclose(fp);
+                *drops = count;
+                return true;
+            }
+        }
+        fclose(fp);
+    }
+    return false;
+#else
+    (void)sockfd; (void)drops;
+    return false;
+#endif
+}
+
+/* bind an upstream socket to a random unprivileged port (the kernel picks one if all tries are taken) */
+void bind_random_port(int sockfd, int family) {
+    for (int i = 0; i < 16; ++i) {
+        portno_t port = 1024 + arc4random_uniform(65536 - 1024);
+        skaddr6_t skaddr = {0};
+        socklen_t skaddrlen = 0;
+        if (family == AF_INET) {
+            skaddr4_t *skaddr4 = (skaddr4_t *)&skaddr;
+            skaddr4->sin_family = AF_INET;
+            skaddr4->sin_addr.s_addr = htonl(INADDR_ANY);
+            skaddr4->sin_port = htons(port);
+            skaddrlen = sizeof(skaddr4_t);
+        } else {
+            skaddr.sin6_family = AF_INET6;
+            skaddr.sin6_addr = in6addr_any;
+            skaddr.sin6_port = htons(port);
+            skaddrlen = sizeof(skaddr6_t);
+        }
+        if (bind(sockfd, (void *)&skaddr, skaddrlen) == 0) return;
+        if (errno != EADDRINUSE) break;
+    }
+    LOGERR("[bind_random_port] failed to bind a random port, leave it to the kernel: (%d) %s", errno, strerror(errno));
+}
+
 /* AF_INET or AF_INET6 or -1(invalid) */
 int get_ipstr_family(const char *ipstr) {
     if (!ipstr) return -1;
@@ -50,6 +50,18 @@ void set_reuse_port(int sockfd);
 /* create a udp socket (v4/v6) */
 int new_udp_socket(int family);
 
+/* setsockopt(SO_RCVBUF/SO_SNDBUF) when size > 0, return the size in effect (the kernel may clamp or double it) */
+int set_socket_bufsize(int sockfd, int optname, int size);
+
+/* setsockopt(SO_BUSY_POLL) where supported, false if unsupported or not permitted */
+bool set_busy_poll(int sockfd, int usec);
+
+/* kernel drops of received udp datagrams (socket buffer full), false if unavailable */
+bool get_udp_drops(int sockfd, uint64_t *drops);
+
+/* bind an upstream socket to a random unprivileged port (the kernel picks one if all tries are taken) */
+void bind_random_port(int sockfd, int family);
+
 /* AF_INET or AF_INET6 or -1(invalid) */
 int get_ipstr_family(const char *ipstr);
 
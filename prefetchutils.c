@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include "prefetchutils.h"
+#include "dnsutils.h"
+#include "logutils.h"
+#include "uthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#undef _GNU_SOURCE
+
+/* names tracked per prefetched name (the tail of the table is where new names climb up) */
+#define PREFETCH_TABLE_FACTOR 16
+
+/* a name must be queried this often in a period to be prefetched */
+#define PREFETCH_MIN_HITS 2
+
+/* save the table every N runs (and at exit) */
+#define PREFETCH_SAVE_RUNS 30
+
+/* hash entry, the key is `qtype` followed by `dname` (without '\0') */
+typedef struct {
+    myhash_hh hh;
+    uint32_t  hits;
+    uint16_t  qtype;
+    char      dname[];
+} prefentry_t;
+
+static prefentry_t *g_prefetch_table = NULL;
+static size_t       g_prefetch_count = 0;
+static size_t       g_prefetch_runs  = 0;
+static const char  *g_prefetch_fname = NULL;
+
+static void prefetch_add(const char *dname, uint16_t qtype, uint32_t hits) {
+    size_t dnamelen = strlen(dname);
+    char keybuf[sizeof(uint16_t) + DNS_DOMAIN_NAME_MAXLEN];
+    memcpy(keybuf, &qtype, sizeof(uint16_t));
+    memcpy(keybuf + sizeof(uint16_t), dname, dnamelen);
+
+    prefentry_t *entry = NULL;
+    MYHASH_GET(g_prefetch_table, entry, keybuf, sizeof(uint16_t) + dnamelen);
+    if (entry) {
+        entry->hits += hits;
+        return;
+    }
+    if (MYHASH_CNT(g_prefetch_table) >= g_prefetch_count * PREFETCH_TABLE_FACTOR) return; /* full until the next decay */
+    entry = malloc(sizeof(prefentry_t) + dnamelen + 1);
+    entry->hits = hits;
+    entry->qtype = qtype;
+    memcpy(entry->dname, dname, dnamelen + 1);
+    MYHASH_ADD(g_prefetch_table, entry, &entry->qtype, sizeof(uint16_t) + dnamelen);
+}
+
+/* keep the `count` most popular names warm, the table is loaded from and saved to `fname` (may be NULL) */
+void prefetch_init(size_t count, const char *fname) {
+    g_prefetch_count = count;
+    g_prefetch_fname = fname;
+    if (!fname) return;
+    atexit(prefetch_save);
+
+    FILE *fp = fopen(fname, "rb");
+    if (!fp) {
+        if (errno != ENOENT) LOGERR("[prefetch_init] failed to open '%s': (%d) %s", fname, errno, strerror(errno));
+        return;
+    }
+    uint32_t hits = 0;
+    uint16_t qtype = 0;
+    char dname[DNS_DOMAIN_NAME_MAXLEN];
+    while (fscanf(fp, "%u %hu %253s", &hits, &qtype, dname) == 3) { /* "hits qtype dname" */
+        if (dns_dname_check(dname)) prefetch_add(dname, qtype, hits); /* hand-edited or truncated lines are skipped */
+    }
+    fclose(fp);
+}
+
+/* is prefetching enabled */
+bool prefetch_enabled(void) {
+    return g_prefetch_count > 0;
+}
+
+/* count a query of a list-matched name */
+void prefetch_hit(const char *dname, uint16_t qtype) {
+    prefetch_add(dname, qtype, 1);
+}
+
+static int prefentry_cmp(const void *a, const void *b) {
+    uint32_t hits_a = (*(prefentry_t *const *)a)->hits, hits_b = (*(prefentry_t *const *)b)->hits;
+    return hits_a < hits_b ? 1 : hits_a > hits_b ? -1 : 0;
+}
+
+/* pass the most popular names to `fetch_cb`, then halve every counter (called periodically) */
+void prefetch_run(prefetch_cb_t fetch_cb) {
+    size_t entry_count = MYHASH_CNT(g_prefetch_table);
+    if (entry_count == 0) return;
+
+    prefentry_t **entries = malloc(entry_count * sizeof(prefentry_t *));
+    prefentry_t *entry = NULL, *tmp = NULL;
+    size_t i = 0;
+    MYHASH_FOR(g_prefetch_table, entry, tmp) entries[i++] = entry;
+    qsort(entries, entry_count, sizeof(prefentry_t *), prefentry_cmp);
+    for (i = 0; i < entry_count && i < g_prefetch_count && entries[i]->hits >= PREFETCH_MIN_HITS; ++i) {
+        fetch_cb(entries[i]->dname, entries[i]->qtype);
+    }
+    free(entries);
+
+    if (g_prefetch_fname && ++g_prefetch_runs % PREFETCH_SAVE_RUNS == 0) prefetch_save();
+
+    MYHASH_FOR(g_prefetch_table, entry, tmp) {
+        entry->hits >>= 1;
+        if (entry->hits == 0) {
+            MYHASH_DEL(g_prefetch_table, entry);
+            free(entry);
+        }
+    }
+}
+
+/* write the popularity table to the file */
+void prefetch_save(void) {
+    char tmp_fname[strlen(g_prefetch_fname) + sizeof(".tmp")];
+    sprintf(tmp_fname, "%s.tmp", g_prefetch_fname);
+    FILE *fp = fopen(tmp_fname, "wb");
+    if (!fp) {
+        LOGERR("[prefetch_save] failed to open '%s': (%d) %s", tmp_fname, errno, strerror(errno));
+        return;
+    }
+    prefentry_t *entry = NULL, *tmp = NULL;
+    MYHASH_FOR(g_prefetch_table, entry, tmp) {
+        fprintf(fp, "%u %hu %s\n", entry->hits, entry->qtype, entry->dname);
+    }
+    if (fclose(fp) || rename(tmp_fname, g_prefetch_fname)) {
+        LOGERR("[prefetch_save] failed to write '%s': (%d) %s", g_prefetch_fname, errno, strerror(errno));
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef CHINADNS_NG_PREFETCHUTILS_H
+#define CHINADNS_NG_PREFETCHUTILS_H
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#undef _GNU_SOURCE
+
+/* called by prefetch_run() for each popular name */
+typedef void (*prefetch_cb_t)(const char *dname, uint16_t qtype);
+
+/* keep the `count` most popular names warm, the table is loaded from and saved to `fname` (may be NULL) */
+void prefetch_init(size_t count, const char *fname);
+
+/* is prefetching enabled */
+bool prefetch_enabled(void);
+
+/* count a query of a list-matched name */
+void prefetch_hit(const char *dname, uint16_t qtype);
+
+/* pass the most popular names to `fetch_cb`, then halve every counter (called periodically) */
+void prefetch_run(prefetch_cb_t fetch_cb);
+
+/* write the popularity table to the file */
+void prefetch_save(void);
+
+#endif
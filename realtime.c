@@ -49,9 +49,19 @@ static uint64_t hrtime(uv_clocktype_t type) {
 	return t.tv_sec * (uint64_t)1e9 + t.tv_nsec;
 }
 
-uint64_t GetTime()
+static uint64_t hrtime_us(void)
+{
+	return hrtime(CLOCK_PRECISE) / 1000;
+}
+
+static uint64_t walltime_us(void)
 {
-	return hrtime(CLOCK_FAST) / 1000000;
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_REALTIME, &t))
+		return 0;
+
+	return t.tv_sec * (uint64_t)1000000 + t.tv_nsec / 1000;
 }
 
 #else
@@ -59,7 +69,7 @@ uint64_t GetTime()
 /* Interval (in seconds) of the high-resolution clock. */
 static double hrtime_interval_ = 0;
 
-uint64_t GetTime()
+static uint64_t hrtime_us(void)
 {
 	LARGE_INTEGER counter;
 
@@ -76,7 +86,12 @@ uint64_t GetTime()
 	 * performance counter interval, integer math could cause this computation
 	 * to overflow. Therefore we resort to floating point math.
 	 */
-	return (uint64_t)((double)counter.QuadPart * hrtime_interval_ * 1000);
+	return (uint64_t)((double)counter.QuadPart * hrtime_interval_ * 1000000);
+}
+
+static uint64_t walltime_us(void)
+{
+	return (uint64_t)time(NULL) * 1000000;
 }
 
 void InitRealTime(void)
@@ -95,3 +110,32 @@ void InitRealTime(void)
 }
 
 #endif
+
+static uint64_t g_cached_time_us = 0;
+static uint64_t g_cached_walltime_us = 0;
+
+void UpdateRealTime(void)
+{
+	g_cached_time_us = hrtime_us();
+	g_cached_walltime_us = walltime_us();
+}
+
+uint64_t GetTime()
+{
+	return g_cached_time_us / 1000;
+}
+
+uint64_t GetTimeUs(void)
+{
+	return g_cached_time_us;
+}
+
+time_t GetWallTime(void)
+{
+	return (time_t)(g_cached_walltime_us / 1000000);
+}
+
+uint64_t GetWallTimeUs(void)
+{
+	return g_cached_walltime_us;
+}
@@ -1,6 +1,9 @@
 ﻿#ifndef _REALTIME_H_INCLUDED_
 #define _REALTIME_H_INCLUDED_
 
+#include <stdint.h>
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,8 +14,24 @@ void InitRealTime(void);
 #define InitRealTime()
 #endif
 
+/*
+ * The clocks are sampled once per event loop iteration by UpdateRealTime(),
+ * every other caller (event loop, timers, logging, tap) reads the cache.
+ */
+void UpdateRealTime(void);
+
+/* cached monotonic time in milliseconds */
 uint64_t GetTime();
 
+/* cached monotonic time in microseconds (for rtt measurement) */
+uint64_t GetTimeUs(void);
+
+/* cached wall-clock time in seconds */
+time_t GetWallTime(void);
+
+/* cached wall-clock time in microseconds */
+uint64_t GetWallTimeUs(void);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "taputils.h"
+#include "logutils.h"
+#include "realtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#undef _GNU_SOURCE
+
+/* record buffer for file output */
+#define TAP_BUFFER_SIZE 65536
+#define TAP_RECORD_MAXLEN (sizeof(taprecord_t) + UINT8_MAX)
+
+static int      g_tap_fd                        = -1;
+static bool     g_tap_is_socket                 = false;
+static uint32_t g_tap_sample_rate               = 1;
+static uint32_t g_tap_sample_count              = 0;
+static char     g_tap_domain[256]               = {0};
+static size_t   g_tap_domainlen                 = 0;
+static size_t   g_tap_buflen                    = 0;
+static char     g_tap_buffer[TAP_BUFFER_SIZE];
+
+/* open the tap output, `path` is a file or "unix:<socket-path>" */
+void tap_init(const char *path, uint32_t sample_rate, const char *domain) {
+    if (strncmp(path, "unix:", 5) == 0) {
+        struct sockaddr_un skaddr = {0};
+        skaddr.sun_family = AF_UNIX;
+        if (strlen(path + 5) + 1 > sizeof(skaddr.sun_path)) {
+            LOGERR("[tap_init] unix socket path is too long: %s", path + 5);
+            exit(1);
+        }
+        strcpy(skaddr.sun_path, path + 5);
+        g_tap_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (g_tap_fd < 0 || connect(g_tap_fd, (void *)&skaddr, sizeof(skaddr))) {
+            LOGERR("[tap_init] failed to connect to %s: (%d) %s", path + 5, errno, strerror(errno));
+            exit(errno);
+        }
+        g_tap_is_socket = true;
+    } else {
+        g_tap_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (g_tap_fd < 0) {
+            LOGERR("[tap_init] failed to open '%s': (%d) %s", path, errno, strerror(errno));
+            exit(errno);
+        }
+        atexit(tap_flush);
+    }
+    g_tap_sample_rate = sample_rate ? sample_rate : 1;
+    if (domain) {
+        g_tap_domainlen = strlen(domain);
+        if (g_tap_domainlen + 1 > sizeof(g_tap_domain)) g_tap_domainlen = sizeof(g_tap_domain) - 1;
+        memcpy(g_tap_domain, domain, g_tap_domainlen);
+    }
+}
+
+/* is the tap enabled */
+bool tap_enabled(void) {
+    return g_tap_fd >= 0;
+}
+
+/* "www.example.com" matches "example.com" and "www.example.com" */
+static bool tap_domain_match(const char *dname) {
+    size_t dnamelen = strlen(dname);
+    if (dnamelen < g_tap_domainlen) return false;
+    if (strncasecmp(dname + dnamelen - g_tap_domainlen, g_tap_domain, g_tap_domainlen)) return false; /* names are case-insensitive */
+    return dnamelen == g_tap_domainlen || dname[dnamelen - g_tap_domainlen - 1] == '.';
+}
+
+/* decide whether the query of `dname` is sampled (called once per query) */
+bool tap_sample(const char *dname) {
+    if (g_tap_fd < 0) return false;
+    if (g_tap_domainlen && !tap_domain_match(dname)) return false;
+    if (++g_tap_sample_count < g_tap_sample_rate) return false;
+    g_tap_sample_count = 0;
+    return true;
+}
+
+/* write out the buffered records (called at loop idle time) */
+void tap_flush(void) {
+    size_t offset = 0;
+    while (offset < g_tap_buflen) {
+        ssize_t nwrite = write(g_tap_fd, g_tap_buffer + offset, g_tap_buflen - offset);
+        if (nwrite < 0) {
+            if (errno == EINTR) continue;
+            LOGERR("[tap_flush] failed to write tap records: (%d) %s", errno, strerror(errno));
+            break;
+        }
+        offset += nwrite;
+    }
+    g_tap_buflen = 0;
+}
+
+/* append a record (no allocation, buffered for file output) */
+void tap_write(uint8_t verdict, uint8_t upstream, uint8_t dnlmatch, uint16_t msgid, uint32_t latency_us, const char *dname) {
+    if (g_tap_fd < 0) return;
+    if (!g_tap_is_socket && TAP_BUFFER_SIZE - g_tap_buflen < TAP_RECORD_MAXLEN) tap_flush();
+
+    char recbuf[TAP_RECORD_MAXLEN];
+    taprecord_t *record = g_tap_is_socket ? (void *)recbuf : (void *)(g_tap_buffer + g_tap_buflen);
+    size_t namelen = dname ? strlen(dname) : 0;
+    if (namelen > UINT8_MAX) namelen = UINT8_MAX;
+
+    record->reclen = sizeof(taprecord_t) + namelen;
+    record->verdict = verdict;
+    record->upstream = upstream;
+    record->dnlmatch = dnlmatch;
+    record->namelen = namelen;
+    record->msgid = msgid;
+    record->latency_us = latency_us;
+    record->reserved = 0;
+    record->timestamp_us = GetWallTimeUs();
+    if (namelen) memcpy(record->qname, dname, namelen);
+
+    if (g_tap_is_socket) {
+        send(g_tap_fd, record, record->reclen, MSG_DONTWAIT); /* drop the record if the reader is slow */
+    } else {
+        g_tap_buflen += record->reclen;
+    }
+}
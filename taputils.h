@@ -0,0 +1,51 @@
+#ifndef CHINADNS_NG_TAPUTILS_H
+#define CHINADNS_NG_TAPUTILS_H
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#undef _GNU_SOURCE
+
+/* taprecord_t.verdict */
+#define TAP_VERDICT_QUERY   0 // query received from client
+#define TAP_VERDICT_ACCEPT  1 // reply forwarded to client
+#define TAP_VERDICT_FILTER  2 // reply dropped (not china ip)
+#define TAP_VERDICT_DELAY   3 // trust-dns reply held for china-dns
+#define TAP_VERDICT_IGNORE  4 // reply arrived after the decision
+#define TAP_VERDICT_TIMEOUT 5 // no acceptable reply in time
+
+/* taprecord_t.upstream (for client-side events) */
+#define TAP_UPSTREAM_NONE  0xff
+#define TAP_UPSTREAM_CACHE 0xfe // answered from the cache
+#define TAP_UPSTREAM_RULE  0xfd // answered by a routing rule
+
+/* binary tap record (host byte order), followed by `namelen` bytes of qname */
+typedef struct {
+    uint16_t reclen;       // total record length (including qname)
+    uint8_t  verdict;      // TAP_VERDICT_*
+    uint8_t  upstream;     // upstream index or TAP_UPSTREAM_*
+    uint8_t  dnlmatch;     // dnl_ismatch() result of the query
+    uint8_t  namelen;      // qname length (without '\0')
+    uint16_t msgid;        // unique msgid of the query
+    uint32_t latency_us;   // time elapsed since the query was received
+    uint32_t reserved;     // zero
+    uint64_t timestamp_us; // wall-clock time of the event
+    char     qname[];      // "www.example.com" (not '\0'-terminated)
+} __attribute__((packed)) taprecord_t;
+
+/* open the tap output, `path` is a file or "unix:<socket-path>" */
+void tap_init(const char *path, uint32_t sample_rate, const char *domain);
+
+/* is the tap enabled */
+bool tap_enabled(void);
+
+/* decide whether the query of `dname` is sampled (called once per query) */
+bool tap_sample(const char *dname);
+
+/* append a record (no allocation, buffered for file output) */
+void tap_write(uint8_t verdict, uint8_t upstream, uint8_t dnlmatch, uint16_t msgid, uint32_t latency_us, const char *dname);
+
+/* write out the buffered records (called at loop idle time) */
+void tap_flush(void);
+
+#endif
@@ -12,6 +12,32 @@
 #define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
 
 
+/*
+ * Timers started with the same duration expire in the order they were
+ * started, so they are kept in per-duration FIFO lists instead of the
+ * heap: arm and cancel are O(1). The first few distinct durations get a
+ * list, any other duration falls back to the heap.
+ */
+#define TIMER_FIFO_MAXCOUNT 8
+
+typedef struct timer_fifo_s
+{
+	uint64_t duration;
+	htimer_t* head;
+	htimer_t* tail;
+} timer_fifo_t;
+
+static timer_fifo_t g_timer_fifos[TIMER_FIFO_MAXCOUNT];
+static int g_timer_fifo_count = 0;
+
+/* htimer_t.active */
+#define TIMER_INACTIVE 0
+#define TIMER_ACTIVE 1
+#define TIMER_EXPIRING 2 /* due, waiting in g_timer_expired for its callback */
+
+/* timers collected by run_timers() (linked through fifo_prev/fifo_next) */
+static timer_fifo_t g_timer_expired;
+
 static struct heap g_timer_heap;
 static uint64_t loop_time = 0;
 static uint64_t timer_counter = 0;
@@ -59,12 +85,72 @@ static int timer_less_than(const struct heap_node* ha,
 	return 0;
 }
 
+//
+// Purpose: 
+//
+static int timer_fifo_index(uint64_t duration)
+{
+	int i;
+
+	for (i = 0; i < g_timer_fifo_count; i++)
+	{
+		if (g_timer_fifos[i].duration == duration)
+			return i;
+	}
+
+	if (g_timer_fifo_count == TIMER_FIFO_MAXCOUNT)
+		return -1;
+
+	g_timer_fifos[g_timer_fifo_count].duration = duration;
+	g_timer_fifos[g_timer_fifo_count].head = NULL;
+	g_timer_fifos[g_timer_fifo_count].tail = NULL;
+	return g_timer_fifo_count++;
+}
+
+//
+// Purpose: 
+//
+static void timer_fifo_append(timer_fifo_t* fifo, htimer_t* handle)
+{
+	handle->fifo_prev = fifo->tail;
+	handle->fifo_next = NULL;
+
+	if (fifo->tail)
+		fifo->tail->fifo_next = handle;
+	else
+		fifo->head = handle;
+
+	fifo->tail = handle;
+}
+
+//
+// Purpose: 
+//
+static void timer_fifo_unlink(timer_fifo_t* fifo, htimer_t* handle)
+{
+	if (handle->fifo_prev)
+		handle->fifo_prev->fifo_next = handle->fifo_next;
+	else
+		fifo->head = handle->fifo_next;
+
+	if (handle->fifo_next)
+		handle->fifo_next->fifo_prev = handle->fifo_prev;
+	else
+		fifo->tail = handle->fifo_prev;
+
+	handle->fifo_prev = NULL;
+	handle->fifo_next = NULL;
+}
+
 //
 // Purpose: 
 //
 void timer_init(htimer_t* handle)
 {
-	handle->active = 0;
+	handle->fifo_prev = NULL;
+	handle->fifo_next = NULL;
+	handle->fifo_index = -1;
+	handle->active = TIMER_INACTIVE;
 	handle->timer_cb = NULL;
 	handle->repeat = 0;
 }
@@ -85,7 +171,8 @@ int timer_start(htimer_t* handle,
 	if (handle->active)
 		timer_stop(handle);
 
-	clamped_timeout = loop_time + timeout;
+	/* the clock refreshed when the event wait returned, loop_time may be a whole wait old */
+	clamped_timeout = (uint64_t)GetTime() + timeout;
 	if (clamped_timeout < timeout)
 		clamped_timeout = (uint64_t)-1;
 
@@ -95,11 +182,15 @@ int timer_start(htimer_t* handle,
 	/* start_id is the second index to be compared in uv__timer_cmp() */
 	handle->start_id = timer_counter++;
 
-	heap_insert(timer_heap(),
-				(struct heap_node*)&handle->heap_node,
-				timer_less_than);
+	handle->fifo_index = timer_fifo_index(timeout);
+	if (handle->fifo_index >= 0)
+		timer_fifo_append(&g_timer_fifos[handle->fifo_index], handle);
+	else
+		heap_insert(timer_heap(),
+					(struct heap_node*)&handle->heap_node,
+					timer_less_than);
 
-	handle->active = 1;
+	handle->active = TIMER_ACTIVE;
 
 	return 0;
 }
@@ -112,11 +203,16 @@ int timer_stop(htimer_t* handle)
 	if (!handle->active)
 		return 0;
 
-	heap_remove(timer_heap(),
-				(struct heap_node*)&handle->heap_node,
-				timer_less_than);
+	if (handle->active == TIMER_EXPIRING)
+		timer_fifo_unlink(&g_timer_expired, handle);
+	else if (handle->fifo_index >= 0)
+		timer_fifo_unlink(&g_timer_fifos[handle->fifo_index], handle);
+	else
+		heap_remove(timer_heap(),
+					(struct heap_node*)&handle->heap_node,
+					timer_less_than);
 
-	handle->active = 0;
+	handle->active = TIMER_INACTIVE;
 	return 0;
 }
 
@@ -155,12 +251,61 @@ uint64_t timer_get_repeat(const htimer_t* handle)
 }
 
 
+//
+// Purpose: earliest active timer (heap minimum or a list head)
+//
+static htimer_t* timer_next(void)
+{
+	struct heap_node* heap_node;
+	htimer_t* next = NULL;
+	htimer_t* head;
+	int i;
+
+	heap_node = heap_min(timer_heap());
+	if (heap_node)
+		next = container_of(heap_node, htimer_t, heap_node);
+
+	for (i = 0; i < g_timer_fifo_count; i++)
+	{
+		head = g_timer_fifos[i].head;
+		if (head == NULL)
+			continue;
+
+		if (next == NULL || timer_less_than((struct heap_node*)&head->heap_node,
+											(struct heap_node*)&next->heap_node))
+			next = head;
+	}
+
+	return next;
+}
+
+//
+// Purpose: milliseconds until the earliest timer is due (0: due now, -1: no active timer)
+//
+int64_t timer_next_timeout(void)
+{
+	htimer_t* handle;
+	uint64_t now;
+
+	if (g_timer_expired.head != NULL)
+		return 0;
+
+	handle = timer_next();
+	if (handle == NULL)
+		return -1;
+
+	now = (uint64_t)GetTime();
+	if (handle->timeout <= now)
+		return 0;
+
+	return (int64_t)(handle->timeout - now);
+}
+
 //
 // Purpose: 
 //
 void run_timers()
 {
-	struct heap_node* heap_node;
 	htimer_t* handle;
 
 	uint64_t new_time = (uint64_t)GetTime();
@@ -168,18 +313,32 @@ void run_timers()
 	assert(new_time >= loop_time);
 	loop_time = new_time;
 
+	/* collect every due timer first (in expiry order), list heads are unlinked in O(1) */
 	for (;;)
 	{
-		heap_node = heap_min(timer_heap());
-		if (heap_node == NULL)
+		handle = timer_next();
+		if (handle == NULL || handle->timeout > loop_time)
 			break;
 
-		handle = container_of(heap_node, htimer_t, heap_node);
-		if (handle->timeout > loop_time)
-			break;
+		if (handle->fifo_index >= 0)
+			timer_fifo_unlink(&g_timer_fifos[handle->fifo_index], handle);
+		else
+			heap_dequeue(timer_heap(), timer_less_than);
+
+		handle->active = TIMER_EXPIRING;
+		timer_fifo_append(&g_timer_expired, handle);
+	}
+
+	/* then run the callbacks, a callback may stop timers still in the batch */
+	while ((handle = g_timer_expired.head) != NULL)
+	{
+		timer_fifo_unlink(&g_timer_expired, handle);
+		handle->active = TIMER_INACTIVE;
+
+		/* one-shot timers (repeat == 0) are not touched again */
+		if (handle->repeat)
+			timer_start(handle, handle->timer_cb, handle->repeat, handle->repeat);
 
-		timer_stop(handle);
-		timer_again(handle);
 		handle->timer_cb(handle);
 	}
 }
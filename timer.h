@@ -9,6 +9,9 @@ typedef void(*htimer_cb_t)(struct htimer_s* handle);
 struct htimer_s
 {
 	void* heap_node[3];
+	struct htimer_s* fifo_prev;
+	struct htimer_s* fifo_next;
+	int fifo_index; /* fixed-duration list index, -1: in the heap */
 	int active;
 	uint64_t timeout;
 	uint64_t repeat;
@@ -26,4 +29,5 @@ int timer_stop(htimer_t* handle);
 int timer_again(htimer_t* handle);
 void timer_set_repeat(htimer_t* handle, uint64_t repeat);
 uint64_t timer_get_repeat(const htimer_t* handle);
+int64_t timer_next_timeout(void);
 void run_timers();
\ No newline at end of file
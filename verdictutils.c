@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+#include "verdictutils.h"
+#include "dnsutils.h"
+#include "uthash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#undef _GNU_SOURCE
+
+/* consistent observations needed before queries are routed by a verdict */
+#define VERDICT_MIN_SCORE 2
+#define VERDICT_MAX_SCORE 8
+
+/* hash entry, the key is the registered domain (lowercase, without '\0') */
+typedef struct {
+    myhash_hh hh;
+    uint8_t   verdict;
+    uint8_t   score;
+    char      dname[];
+} verdentry_t;
+
+static verdentry_t *g_verdict_table    = NULL; /* the head is the least recently used entry */
+static size_t       g_verdict_capacity = 0;
+
+/* second-level labels under which country tlds register names ("example.com.cn", "example.co.uk") */
+static const char *const g_generic_slds[] = {"com", "net", "org", "gov", "edu", "ac", "co", "or", "ne", "go"};
+
+/* "a.www.example.com.cn" => "example.com.cn", lowercased into `keybuf` (an approximation of eTLD+1), return the length */
+static size_t registered_domain(const char *dname, char keybuf[DNS_DOMAIN_NAME_MAXLEN]) {
+    size_t dnamelen = strlen(dname);
+    if (dnamelen < 1 || dname[0] == '.' || dnamelen >= DNS_DOMAIN_NAME_MAXLEN) return 0; /* root-domain */
+
+    size_t starts[3] = {0}; /* start of the last, second-last and third-last label */
+    unsigned count = 0;
+    for (size_t i = dnamelen; i > 0 && count < 3; --i) {
+        if (dname[i - 1] == '.') starts[count++] = i;
+    }
+    if (count < 3) starts[count++] = 0; /* the first label */
+
+    size_t start = starts[count > 1 ? 1 : 0];
+    if (count == 3 && dnamelen - starts[0] == 2) { /* country tld */
+        size_t sldlen = starts[0] - 1 - starts[1];
+        for (size_t i = 0; i < sizeof(g_generic_slds) / sizeof(*g_generic_slds); ++i) {
+            if (strlen(g_generic_slds[i]) == sldlen && strncasecmp(dname + starts[1], g_generic_slds[i], sldlen) == 0) {
+                start = starts[2];
+                break;
+            }
+        }
+    }
+    size_t keylen = dnamelen - start;
+    for (size_t i = 0; i < keylen; ++i) keybuf[i] = tolower((unsigned char)dname[start + i]);
+    return keylen;
+}
+
+/* move the entry to the tail (most recently used) */
+static inline void verdict_touch(verdentry_t *entry) {
+    unsigned keylen = entry->hh.keylen;
+    MYHASH_DEL(g_verdict_table, entry);
+    MYHASH_ADD(g_verdict_table, entry, entry->dname, keylen);
+}
+
+/* remember the verdicts of up to `capacity` registered domains (least recently used evicted) */
+void verdict_init(size_t capacity) {
+    g_verdict_capacity = capacity;
+}
+
+/* is verdict learning enabled */
+bool verdict_enabled(void) {
+    return g_verdict_capacity > 0;
+}
+
+/* the confident verdict of the registered domain of `dname` */
+uint8_t verdict_get(const char *dname) {
+    char keybuf[DNS_DOMAIN_NAME_MAXLEN];
+    size_t keylen = registered_domain(dname, keybuf);
+    if (!keylen) return VERDICT_NONE;
+
+    verdentry_t *entry = NULL;
+    MYHASH_GET(g_verdict_table, entry, keybuf, keylen);
+    if (!entry || entry->score < VERDICT_MIN_SCORE) return VERDICT_NONE;
+    verdict_touch(entry);
+    return entry->verdict;
+}
+
+/* record a verdict observed for `dname` (from the chnroute check of a china-dns reply) */
+void verdict_learn(const char *dname, uint8_t verdict) {
+    char keybuf[DNS_DOMAIN_NAME_MAXLEN];
+    size_t keylen = registered_domain(dname, keybuf);
+    if (!keylen) return;
+
+    verdentry_t *entry = NULL;
+    MYHASH_GET(g_verdict_table, entry, keybuf, keylen);
+    if (!entry) {
+        if (MYHASH_CNT(g_verdict_table) >= g_verdict_capacity) {
+            verdentry_t *oldest = g_verdict_table;
+            MYHASH_DEL(g_verdict_table, oldest);
+            free(oldest);
+        }
+        entry = malloc(sizeof(verdentry_t) + keylen);
+        entry->verdict = verdict;
+        entry->score = 1;
+        memcpy(entry->dname, keybuf, keylen);
+        MYHASH_ADD(g_verdict_table, entry, entry->dname, keylen);
+        return;
+    }
+    if (entry->verdict == verdict) {
+        if (entry->score < VERDICT_MAX_SCORE) ++entry->score;
+    } else if (--entry->score == 0) { /* contradicted often enough: start over with the new verdict */
+        entry->verdict = verdict;
+        entry->score = 1;
+    }
+    verdict_touch(entry);
+}
+
+/* drop the verdict of the registered domain of `dname` (it was contradicted on the single-upstream path) */
+void verdict_forget(const char *dname) {
+    char keybuf[DNS_DOMAIN_NAME_MAXLEN];
+    size_t keylen = registered_domain(dname, keybuf);
+    if (!keylen) return;
+
+    verdentry_t *entry = NULL;
+    MYHASH_GET(g_verdict_table, entry, keybuf, keylen);
+    if (!entry) return;
+    MYHASH_DEL(g_verdict_table, entry);
+    free(entry);
+}
+
+/* halve every score, domains not seen for a while are forgotten (called periodically) */
+void verdict_decay(void) {
+    verdentry_t *entry = NULL, *tmp = NULL;
+    MYHASH_FOR(g_verdict_table, entry, tmp) {
+        entry->score >>= 1;
+        if (entry->score == 0) {
+            MYHASH_DEL(g_verdict_table, entry);
+            free(entry);
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef CHINADNS_NG_VERDICTUTILS_H
+#define CHINADNS_NG_VERDICTUTILS_H
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#undef _GNU_SOURCE
+
+/* learned routing verdict of a registered domain */
+#define VERDICT_NONE    0 // unknown or not confident yet
+#define VERDICT_CHINA   1 // china-dns answered with a china ip
+#define VERDICT_FOREIGN 2 // china-dns answered with a foreign ip
+
+/* remember the verdicts of up to `capacity` registered domains (least recently used evicted) */
+void verdict_init(size_t capacity);
+
+/* is verdict learning enabled */
+bool verdict_enabled(void);
+
+/* the confident verdict of the registered domain of `dname` */
+uint8_t verdict_get(const char *dname);
+
+/* record a verdict observed for `dname` (from the chnroute check of a china-dns reply) */
+void verdict_learn(const char *dname, uint8_t verdict);
+
+/* drop the verdict of the registered domain of `dname` (it was contradicted on the single-upstream path) */
+void verdict_forget(const char *dname);
+
+/* halve every score, domains not seen for a while are forgotten (called periodically) */
+void verdict_decay(void);
+
+#endif